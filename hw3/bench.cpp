@@ -0,0 +1,251 @@
+// Benchmark of the hw3 shell commands on generated images.
+// For every combination of the matrix an image is built with mkimage's build_image, then
+// cd, ls, ls -l, cat, mkdir and touch are run through run_command, the same path as run_program.
+// Latency percentiles, ops/sec and I/O syscalls per op (from /proc/self/io) are printed and
+// written as JSON.
+#define MKIMAGE_NO_MAIN
+#include "mkimage.cpp"
+#include <chrono>
+
+#define BENCH_DEFAULT_ITERATIONS 200
+
+struct Bench_Result{
+    Image_Options options;
+    string operation;
+    uint64_t count;
+    double p50_us;
+    double p99_us;
+    double ops_per_sec;
+    double syscalls_per_op;
+};
+
+uint64_t io_syscall_count(){ // read and write like syscalls done by the process so far
+    FILE *io = fopen("/proc/self/io", "r");
+    if(!io){
+        return 0;
+    }
+    char key[64];
+    unsigned long long value;
+    uint64_t count = 0;
+    while(fscanf(io, "%63s %llu", key, &value) == 2){
+        if(!strcmp(key, "syscr:") || !strcmp(key, "syscw:")){
+            count += value;
+        }
+    }
+    fclose(io);
+    return count;
+}
+
+void collect_paths(Import_Node &node, string path, vector<string> &directories, vector<string> &files){
+    if(!node.is_folder){
+        files.push_back(path);
+        return;
+    }
+    directories.push_back(path);
+    for(int i = 0; i < node.children.size(); i++){
+        collect_paths(node.children[i], path == "/" ? "/" + node.children[i].name : path + "/" + node.children[i].name, directories, files);
+    }
+}
+
+vector<int> parse_list(const char *list){ // "1,8,64" -> {1, 8, 64}
+    vector<int> values;
+    string item;
+    for(const char *c = list; ; c++){
+        if(*c == ',' || *c == '\0'){
+            if(!item.empty()){
+                values.push_back(atoi(item.c_str()));
+            }
+            item.clear();
+            if(*c == '\0'){
+                break;
+            }
+        }
+        else{
+            item += *c;
+        }
+    }
+    return values;
+}
+
+Bench_Result measure(Image_Options &options, string operation, vector<string> &commands, DATA_Block &dblock, FAT_Block &fblock){
+    // Run each command once and time it. Output of the commands goes to /dev/null.
+    string current_directory = "/";
+    int current_cluster = ROOT_DIRECTORY;
+    vector<double> latencies;
+    uint64_t syscalls_before = io_syscall_count();
+    auto start = chrono::steady_clock::now();
+    for(int i = 0; i < commands.size(); i++){
+        auto op_start = chrono::steady_clock::now();
+        run_command(commands[i], current_directory, current_cluster, dblock, fblock);
+        cout.flush();
+        latencies.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - op_start).count());
+    }
+    double total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    uint64_t syscalls = io_syscall_count() - syscalls_before;
+    sort(latencies.begin(), latencies.end());
+
+    Bench_Result result;
+    result.options = options;
+    result.operation = operation;
+    result.count = latencies.size();
+    result.p50_us = latencies.empty() ? 0 : latencies[latencies.size() / 2];
+    result.p99_us = latencies.empty() ? 0 : latencies[min(latencies.size() - 1, latencies.size() * 99 / 100)];
+    result.ops_per_sec = total > 0 ? latencies.size() / total : 0;
+    result.syscalls_per_op = latencies.empty() ? 0 : (double) syscalls / latencies.size();
+    return result;
+}
+
+int run_configuration(Image_Options &options, string path_to_image, int iterations, int use_mmap, vector<Bench_Result> &results){
+    Import_Node root;
+    uint64_t directory_count, file_count;
+    if(build_image(path_to_image, options, root, directory_count, file_count) == -1){
+        return -1;
+    }
+    vector<string> directories, files;
+    collect_paths(root, "/", directories, files);
+
+    int fd = open(path_to_image.c_str(), O_RDWR);
+    BPB_struct bpb;
+    if(fd < 0 || read(fd, &bpb, BPBS) != BPBS){
+        if(fd >= 0){
+            close(fd);
+        }
+        return -1;
+    }
+    char *image_map = NULL;
+    if(use_mmap){
+        struct stat image_stat;
+        fstat(fd, &image_stat);
+        image_map = (char *) mmap(NULL, image_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(image_map == MAP_FAILED){
+            image_map = NULL;
+        }
+    }
+    FAT_Block fblock(bpb, fd, image_map);
+    DATA_Block dblock(bpb, fd, image_map);
+    name_index.clear(); // caches belong to the previous image
+    path_cache.invalidate("/");
+
+    // Targets are picked with a seeded generator, so runs are comparable
+    mt19937_64 rng(options.seed);
+    vector<string> cd_commands, ls_commands, ls_l_commands, cat_commands, mkdir_commands, touch_commands;
+    for(int i = 0; i < iterations; i++){
+        string directory = directories[rng() % directories.size()];
+        cd_commands.push_back("cd " + directory);
+        ls_commands.push_back("ls " + directory);
+        ls_l_commands.push_back("ls -l " + directory);
+        if(!files.empty()){
+            cat_commands.push_back("cat " + files[rng() % files.size()]);
+        }
+        mkdir_commands.push_back("mkdir " + (directory == "/" ? "" : directory) + "/bench_directory_" + to_string(i));
+        touch_commands.push_back("touch " + (directory == "/" ? "" : directory) + "/bench_file_" + to_string(i));
+    }
+    results.push_back(measure(options, "cd", cd_commands, dblock, fblock));
+    results.push_back(measure(options, "ls", ls_commands, dblock, fblock));
+    results.push_back(measure(options, "ls -l", ls_l_commands, dblock, fblock));
+    results.push_back(measure(options, "cat", cat_commands, dblock, fblock));
+    results.push_back(measure(options, "mkdir", mkdir_commands, dblock, fblock));
+    results.push_back(measure(options, "touch", touch_commands, dblock, fblock));
+
+    sync_image(dblock, fblock);
+    if(image_map){
+        struct stat image_stat;
+        fstat(fd, &image_stat);
+        munmap(image_map, image_stat.st_size);
+    }
+    close(fd);
+    return 0;
+}
+
+void write_json(const string &path, vector<Bench_Result> &results, int iterations, int use_mmap){
+    FILE *json = fopen(path.c_str(), "w");
+    if(!json){
+        cerr << "bench: cannot write " << path << endl;
+        return;
+    }
+    fprintf(json, "{\n  \"iterations\": %d,\n  \"mmap\": %d,\n  \"uring\": %d,\n  \"results\": [\n", iterations, use_mmap, uring_enabled);
+    for(int i = 0; i < results.size(); i++){
+        Bench_Result &r = results[i];
+        fprintf(json, "    {\"files_per_directory\": %d, \"depth\": %d, \"sectors_per_cluster\": %d, \"fragmentation\": %d, "
+                      "\"operation\": \"%s\", \"count\": %llu, \"p50_us\": %.3f, \"p99_us\": %.3f, "
+                      "\"ops_per_sec\": %.1f, \"syscalls_per_op\": %.3f}%s\n",
+                r.options.files_per_directory, r.options.depth, r.options.sectors_per_cluster, r.options.fragmentation,
+                r.operation.c_str(), (unsigned long long) r.count, r.p50_us, r.p99_us, r.ops_per_sec, r.syscalls_per_op,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(json, "  ]\n}\n");
+    fclose(json);
+}
+
+int main(int argc, char *argv[])
+{
+    // bench [-F files_per_directory,..] [-d depth,..] [-c sectors_per_cluster,..] [-g fragmentation,..]
+    //       [-i iterations] [-o json] [-t image] [-m] [-u]
+    vector<int> directory_sizes = {16, 256, 4096};
+    vector<int> depths = {1, 4};
+    vector<int> cluster_sizes = {1, 8, 64};
+    vector<int> fragmentations = {0, 30};
+    int iterations = BENCH_DEFAULT_ITERATIONS;
+    string json_path = "bench.json";
+    string path_to_image = "bench.img";
+    int use_mmap = 0;
+    int option;
+    while((option = getopt(argc, argv, "F:d:c:g:i:o:t:mu")) != -1){
+        switch(option){
+            case 'F': directory_sizes = parse_list(optarg); break;
+            case 'd': depths = parse_list(optarg); break;
+            case 'c': cluster_sizes = parse_list(optarg); break;
+            case 'g': fragmentations = parse_list(optarg); break;
+            case 'i': iterations = atoi(optarg); break;
+            case 'o': json_path = optarg; break;
+            case 't': path_to_image = optarg; break;
+            case 'm': use_mmap = 1; break;
+            case 'u': uring_enabled = 1; break;
+            default:
+                cerr << "usage: bench [-F sizes] [-d depths] [-c sectors_per_cluster] [-g fragmentations] [-i iterations] [-o json] [-t image] [-m] [-u]" << endl;
+                return 1;
+        }
+    }
+
+    // Commands write to stdout, which goes to /dev/null, the report goes to the original stdout
+    cout.flush();
+    int report_fd = dup(1);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, 1);
+    close(null_fd);
+    FILE *report = fdopen(report_fd, "w");
+
+    vector<Bench_Result> results;
+    fprintf(report, "%8s %6s %6s %6s %-6s %10s %10s %12s %10s\n", "files", "depth", "spc", "frag", "op", "p50_us", "p99_us", "ops/sec", "sys/op");
+    for(int a = 0; a < directory_sizes.size(); a++){
+        for(int b = 0; b < depths.size(); b++){
+            for(int c = 0; c < cluster_sizes.size(); c++){
+                for(int d = 0; d < fragmentations.size(); d++){
+                    Image_Options options;
+                    options.size_mb = 0;
+                    options.files_per_directory = directory_sizes[a];
+                    options.depth = depths[b];
+                    options.fanout = 2;
+                    options.sectors_per_cluster = cluster_sizes[c];
+                    options.fragmentation = fragmentations[d];
+                    options.mean_file_size = 4096;
+                    size_t first = results.size();
+                    if(run_configuration(options, path_to_image, iterations, use_mmap, results) == -1){
+                        continue;
+                    }
+                    for(size_t i = first; i < results.size(); i++){
+                        Bench_Result &r = results[i];
+                        fprintf(report, "%8d %6d %6d %6d %-6s %10.1f %10.1f %12.1f %10.2f\n", options.files_per_directory, options.depth,
+                                options.sectors_per_cluster, options.fragmentation, r.operation.c_str(), r.p50_us, r.p99_us,
+                                r.ops_per_sec, r.syscalls_per_op);
+                    }
+                    fflush(report);
+                }
+            }
+        }
+    }
+    unlink(path_to_image.c_str());
+    write_json(json_path, results, iterations, use_mmap);
+    fclose(report);
+    return 0;
+}
@@ -1,14 +1,45 @@
 #include "fcntl.h"
 #include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "sys/uio.h"
+#include "limits.h"
+#include "errno.h"
+#include "sys/sendfile.h"
+#include "dirent.h"
+#include "fnmatch.h"
+#include "sys/syscall.h"
+#include "linux/io_uring.h"
+#include "sys/socket.h"
+#include "sys/un.h"
+#include "signal.h"
+#include "poll.h"
 #include "fat32.h"
 #include "parser.h"
 
 #include <string>
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <stack>
 #include <queue>
 #include <ctime>
+#include <cstring>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <map>
+#include <chrono>
+#include <algorithm>
 
 using namespace std;
 
@@ -16,418 +47,2063 @@ using namespace std;
 #define BPBS sizeof(BPB_struct)
 #define ROOT_DIRECTORY 2
 #define END_CLUSTER 0x0FFFFFF8
-class FAT_Block{
+#define FSINFO_LEAD_SIG 0x41615252
+#define FSINFO_STRUCT_SIG 0x61417272
+#define FSINFO_FREE_COUNT 488 // Offsets of the fields in the FSInfo sector
+#define FSINFO_NEXT_FREE 492
+#define DEFAULT_CACHE_BUDGET (16 * 1024 * 1024) // Memory budget of the cluster cache in bytes
+#define IO_BUFFER_SIZE (1024 * 1024) // Size of the buffer used for reading file contents
+#define IO_READ 1 // Directions for count_io
+#define IO_WRITE 2
+#define URING_QUEUE_DEPTH 64 // Requests that can be in flight on a ring
+
+struct Io_Stats{
     /*
-        Structure for the FAT block in the file system.
-        To read a block, we have to open a file with descriptor fd.
-        BPB_struct will be assigne throughout this process.
+        Counters of the I/O and the caches, printed by the stats command.
+        They are atomic since the walker and writer threads do I/O as well.
     */
-    BPB_struct bpb; // Holds the information about BPB.
-    int fd = -1;
-    unsigned int fat_start_offset; // Reserved sector should be skipped to reach the offset
-    
-    public:
-        FAT_Block(BPB_struct &bpb_, int fd_){ // Can construct a FAT_block structure if we have bpb. Also provide file descriptor
-                                              // so that we can read from a fat block as well.
-            bpb = bpb_;                 
-            fd = fd_;
-            set_start_offset();
-        }
+    atomic<uint64_t> syscalls{0};
+    atomic<uint64_t> bytes_read{0};
+    atomic<uint64_t> bytes_written{0};
+    atomic<uint64_t> fat_lookups{0}; // Lookups of finished threads, see Lookup_Counter
+    atomic<uint64_t> cluster_reads{0}; // Clusters read from the image
+    atomic<uint64_t> cluster_writes{0}; // Clusters written to the image
+    atomic<uint64_t> allocations{0}; // Clusters allocated
+    atomic<uint64_t> cache_hits{0}; // Cluster cache
+    atomic<uint64_t> cache_misses{0};
+    atomic<uint64_t> index_hits{0}; // Directory index lookups
+    atomic<uint64_t> index_misses{0};
+    atomic<uint64_t> path_hits{0}; // Path cache, a hit resolves at least one component
+    atomic<uint64_t> path_misses{0};
+    atomic<uint64_t> prefetches{0}; // Ranges given to posix_fadvise by the read-ahead thread
+};
 
-        // Set- get method defined for the offset
-        void set_start_offset(){
-            uint16_t bps = bpb.BytesPerSector;
-            uint16_t rsc = bpb.ReservedSectorCount;
-            fat_start_offset = bps*rsc;
-        }
+Io_Stats io_stats;
 
-        unsigned int get_start_offset(){
-            return fat_start_offset;
-        }
+struct Lookup_Counter{ // FAT lookups are counted per thread, the count is added to io_stats when the thread ends
+    uint64_t value = 0;
+    ~Lookup_Counter(){
+        io_stats.fat_lookups += value;
+    }
+};
 
-        unsigned int get_fat_table_size(){
-            return bpb.BytesPerSector * bpb.extended.FATSize;
-        }
-        void write_to_fat(int index, int value){ 
-            int start = get_start_offset();
-            int true_offset = start + index*INTS; 
-            int cluster_id;
+thread_local Lookup_Counter fat_lookup_counter;
+
+ssize_t count_io(ssize_t result, int direction){ // Count a syscall and the bytes it moved, returns result
+    io_stats.syscalls.fetch_add(1, memory_order_relaxed);
+    if(result > 0 && (direction & IO_READ)){
+        io_stats.bytes_read.fetch_add(result, memory_order_relaxed);
+    }
+    if(result > 0 && (direction & IO_WRITE)){
+        io_stats.bytes_written.fetch_add(result, memory_order_relaxed);
+    }
+    return result;
+}
 
-            // Since there can be multiple file allocation table, update the value of FAT for (FAT table times)
-            int fat_table_many = bpb.NumFATs;
-            for(int i = 0; i < fat_table_many; i++){
-                lseek(fd, true_offset, 0); // or use SEEK_SET
-                write(fd, &value, INTS); 
+int uring_enabled = 0; // Set by -u, batches of reads and writes are submitted through io_uring
 
-                // Update the offset by skippnig a fat table size
-                true_offset += get_fat_table_size(); 
+struct Io_Request{ // One read or write of a batch, vectors are filled one after another from offset
+    int direction; // IO_READ or IO_WRITE
+    uint64_t offset;
+    vector<struct iovec> vectors;
+};
 
+int complete_request(int fd, Io_Request &request, uint64_t done){
+    // Do the part of the request after its first done bytes with preadv/pwritev.
+    // Reads beyond the end of the image are filled with zeros. Returns -1 on error.
+    vector<struct iovec> left;
+    for(int i = 0; i < request.vectors.size(); i++){
+        if(done >= request.vectors[i].iov_len){
+            done -= request.vectors[i].iov_len;
+            continue;
+        }
+        struct iovec vec;
+        vec.iov_base = (char *) request.vectors[i].iov_base + done;
+        vec.iov_len = request.vectors[i].iov_len - done;
+        left.push_back(vec);
+        done = 0;
+    }
+    uint64_t offset = request.offset;
+    for(int i = 0; i < request.vectors.size(); i++){
+        offset += request.vectors[i].iov_len;
+    }
+    for(int i = 0; i < left.size(); i++){
+        offset -= left[i].iov_len;
+    }
+    size_t first = 0;
+    while(first < left.size()){
+        int count = left.size() - first < IOV_MAX ? left.size() - first : IOV_MAX;
+        ssize_t r;
+        if(request.direction == IO_READ){
+            r = count_io(preadv(fd, &left[first], count, offset), IO_READ);
+        }
+        else{
+            r = count_io(pwritev(fd, &left[first], count, offset), IO_WRITE);
+        }
+        if(r < 0 && errno == EINTR){
+            continue;
+        }
+        if(r <= 0){
+            if(request.direction != IO_READ){
+                return -1;
             }
-            return;
+            for(; first < left.size(); first++){ // beyond the end of the image
+                memset(left[first].iov_base, 0, left[first].iov_len);
+            }
+            return r < 0 ? -1 : 0;
         }
-
-        unsigned int get_from_fat(int index){
-            int start = get_start_offset();
-            int true_offset = start + index*INTS; 
-            int cluster_id;
-
-            lseek(fd, true_offset, 0); // or use SEEK_SET
-            read(fd, &cluster_id, INTS); // read integer and get the cluster number
-		    return cluster_id & 0x0fffffff; // upper 4 bits should be masked since in FAT32 -> 28 bytes are used for
-										    // each cluster
+        offset += r;
+        while(r > 0){
+            if((size_t) r >= left[first].iov_len){
+                r -= left[first].iov_len;
+                first++;
+            }
+            else{
+                left[first].iov_base = (char *) left[first].iov_base + r;
+                left[first].iov_len -= r;
+                r = 0;
+            }
         }
+    }
+    return 0;
+}
 
-
-
-};
-
-class DATA_Block{
+class Io_Ring{
     /*
-        Structure for reading or writing on the DATA block in the FAT filesystem.
+        io_uring instance of a thread, set up with the raw syscalls. The requests of a batch are put into
+        the submission queue together and one io_uring_enter submits them and waits for the completions,
+        so reading the runs of a fragmented chain costs one syscall instead of one per run.
+        The ring owns a buffer of IO_BUFFER_SIZE bytes that is registered with the kernel. Requests that fall
+        into it use the fixed opcodes, so the pages are not mapped again for every request.
+        If the kernel does not support io_uring (or it is disabled) ring_fd stays -1 and run fails, the caller
+        falls back to preadv/pwritev. Short or failed completions are finished with preadv/pwritev as well.
     */
-    BPB_struct bpb; // Holds the information about BPB.
-    int fd = -1;
-    unsigned int data_start_offset = 0; // Reserved sector should be skipped to reach the offset
-
-    public:
-        DATA_Block(BPB_struct &bpb_, int fd_){ // Can construct a FAT_block structure if we have bpb. Also provide file descriptor
-                                              // so that we can read from a fat block as well.
-            bpb = bpb_;                 
-            fd = fd_;
-            set_start_offset();
+    int ring_fd = -1;
+    unsigned int sq_entries = 0;
+    unsigned int *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring = MAP_FAILED;
+    void *cq_ring = MAP_FAILED;
+    void *sqe_map = MAP_FAILED;
+    size_t sq_ring_size = 0, cq_ring_size = 0, sqe_map_size = 0;
+    vector<char> buffer;
+    int buffer_registered = 0;
+
+    void setup(){
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int ring = syscall(__NR_io_uring_setup, URING_QUEUE_DEPTH, &params);
+        if(ring < 0){ // ENOSYS on old kernels, EPERM if it is disabled
+            return;
         }
-
-        void set_start_offset(){ // Set the offset where the datablock starts.
-            // Skip the reserved sectors
-            uint16_t bps = bpb.BytesPerSector;
-            uint16_t rsc = bpb.ReservedSectorCount;
-            data_start_offset += bps*rsc;
-
-            // Skip the FAT sectors
-            uint32_t spf = bpb.extended.FATSize; // sector_per_fat
-            uint8_t nf = bpb.NumFATs; // num fats
-            data_start_offset += spf * bps * nf;
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if(params.features & IORING_FEAT_SINGLE_MMAP){ // Both rings are in one mapping
+            sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
         }
-
-        unsigned int get_start_offset(){
-            return data_start_offset;
+        sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        if(sq_ring != MAP_FAILED && (params.features & IORING_FEAT_SINGLE_MMAP)){
+            cq_ring = sq_ring;
         }
-
-        unsigned int get_cluster_size(){
-            uint16_t bps = bpb.BytesPerSector;
-            uint16_t spc = bpb.SectorsPerCluster;
-            return  bps * spc;
+        else if(sq_ring != MAP_FAILED){
+            cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
         }
-
-        void write_to_dblock(int index, void *data){ // *data should point to a cluster-sized data.
-            unsigned cluster_size = get_cluster_size();
-
-            unsigned int dblock_offset = get_start_offset();
-            dblock_offset += (index - 2) * cluster_size; // root starts from cluster index 2
-
-            lseek(fd,dblock_offset,0); // go to  the cluster
-            int s = write(fd,data,cluster_size); // write new cluster data to cluster
-            //cout << "s : " << s << endl;
+        sqe_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        if(cq_ring != MAP_FAILED){
+            sqe_map = mmap(NULL, sqe_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
         }
+        if(sqe_map == MAP_FAILED){
+            ring_fd = ring;
+            teardown();
+            return;
+        }
+        ring_fd = ring;
+        sq_entries = params.sq_entries;
+        sq_tail = (unsigned int *) ((char *) sq_ring + params.sq_off.tail);
+        sq_mask = (unsigned int *) ((char *) sq_ring + params.sq_off.ring_mask);
+        sq_array = (unsigned int *) ((char *) sq_ring + params.sq_off.array);
+        sqes = (struct io_uring_sqe *) sqe_map;
+        cq_head = (unsigned int *) ((char *) cq_ring + params.cq_off.head);
+        cq_tail = (unsigned int *) ((char *) cq_ring + params.cq_off.tail);
+        cq_mask = (unsigned int *) ((char *) cq_ring + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *) ((char *) cq_ring + params.cq_off.cqes);
+
+        struct iovec registered;
+        registered.iov_base = buffer.data();
+        registered.iov_len = buffer.size();
+        buffer_registered = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, &registered, 1) == 0;
+    }
 
-        void* get_from_dblock(int index){ // Basically, read the cluster
-            unsigned cluster_size = get_cluster_size();
+    void teardown(){
+        if(sqe_map != MAP_FAILED){
+            munmap(sqe_map, sqe_map_size);
+        }
+        if(cq_ring != MAP_FAILED && cq_ring != sq_ring){
+            munmap(cq_ring, cq_ring_size);
+        }
+        if(sq_ring != MAP_FAILED){
+            munmap(sq_ring, sq_ring_size);
+        }
+        sqe_map = cq_ring = sq_ring = MAP_FAILED;
+        if(ring_fd >= 0){
+            close(ring_fd); // also drops the registered buffer
+        }
+        ring_fd = -1;
+    }
 
-            void *cluster_ptr = new char[cluster_size];
+    void prepare(struct io_uring_sqe *sqe, int fd, Io_Request &request, uint64_t index){
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = fd;
+        sqe->off = request.offset;
+        sqe->user_data = index;
+        char *base = (char *) request.vectors[0].iov_base;
+        if(buffer_registered && request.vectors.size() == 1 && base >= buffer.data() &&
+           base + request.vectors[0].iov_len <= buffer.data() + buffer.size()){
+            sqe->opcode = request.direction == IO_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe->addr = (uint64_t) base;
+            sqe->len = request.vectors[0].iov_len;
+            sqe->buf_index = 0;
+        }
+        else{
+            sqe->opcode = request.direction == IO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+            sqe->addr = (uint64_t) request.vectors.data();
+            sqe->len = request.vectors.size();
+        }
+    }
 
-            unsigned int dblock_offset = get_start_offset();
-            dblock_offset += (index - 2) * cluster_size; // root starts from cluster index 2
-            
-            lseek(fd,dblock_offset,0); // go to  the cluster
-            read(fd,cluster_ptr,cluster_size); // read the cluster
+    public:
+        Io_Ring(){
+            buffer.resize(IO_BUFFER_SIZE);
+            if(uring_enabled){
+                setup();
+            }
+        }
+        Io_Ring(const Io_Ring &) = delete;
+        Io_Ring& operator=(const Io_Ring &) = delete;
+        ~Io_Ring(){
+            teardown();
+        }
 
-            return cluster_ptr;
+        char *get_buffer(){ // IO_BUFFER_SIZE bytes, reads into it use the registered buffer
+            return buffer.data();
         }
 
+        int run(int fd, vector<Io_Request> &requests){
+            // Submit the requests, at most sq_entries at a time, and wait until all of them complete.
+            // Returns -1 if the ring can not be used, the caller should do the requests itself.
+            if(ring_fd < 0){
+                return -1;
+            }
+            size_t next = 0;
+            unsigned int queued = 0; // In the submission queue, not taken by the kernel yet
+            unsigned int in_flight = 0;
+            while(next < requests.size() || queued > 0 || in_flight > 0){
+                unsigned int tail = *sq_tail; // Only this thread writes the tail
+                while(next < requests.size() && queued + in_flight < sq_entries){
+                    unsigned int slot = tail & *sq_mask;
+                    prepare(&sqes[slot], fd, requests[next], next);
+                    sq_array[slot] = slot;
+                    tail++;
+                    queued++;
+                    next++;
+                }
+                __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+                // The kernel can take fewer than queued, so only the requests it took before this call are waited for.
+                // The ones it takes now are waited for in the next round, after it is known how many they are.
+                unsigned int flags = in_flight > 0 ? IORING_ENTER_GETEVENTS : 0;
+                int submitted = count_io(syscall(__NR_io_uring_enter, ring_fd, queued, in_flight, flags, NULL, 0), 0);
+                if(submitted < 0){
+                    if(errno != EINTR && errno != EAGAIN && errno != EBUSY){
+                        return -1;
+                    }
+                    submitted = 0;
+                }
+                queued -= submitted;
+                in_flight += submitted;
+
+                unsigned int head = *cq_head;
+                while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)){
+                    struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+                    Io_Request &request = requests[cqe->user_data];
+                    uint64_t length = 0;
+                    for(int i = 0; i < request.vectors.size(); i++){
+                        length += request.vectors[i].iov_len;
+                    }
+                    if(cqe->res > 0){
+                        (request.direction == IO_READ ? io_stats.bytes_read : io_stats.bytes_written) += cqe->res;
+                    }
+                    if(cqe->res < 0 || (uint64_t) cqe->res < length){ // short or unsupported, finish it with a plain call
+                        complete_request(fd, request, cqe->res > 0 ? cqe->res : 0);
+                    }
+                    head++;
+                    in_flight--;
+                }
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            }
+            return 0;
+        }
 };
 
-// Methods for CD.
-void set_starting_cluster(int &cur_clus, const char *curr_path){
-    int is_absolute = (curr_path[0] == '/');
-    if(is_absolute){
-        cur_clus = ROOT_DIRECTORY;
-    }
+Io_Ring &io_ring(){ // Each thread has its own ring, created with the first use
+    thread_local Io_Ring ring;
+    return ring;
 }
 
-void set_starting_directory(string &cur_dic, const char *curr_path){
-    int is_absolute = (curr_path[0] == '/');
-    if(is_absolute){
-        cur_dic = "/";
+void run_requests(int fd, vector<Io_Request> &requests){
+    // Do a batch of reads and writes. With -u they are submitted through the ring of the thread,
+    // otherwise (or if the kernel has no io_uring) they are done one by one with preadv/pwritev.
+    if(uring_enabled && io_ring().run(fd, requests) == 0){
+        return;
+    }
+    for(int i = 0; i < requests.size(); i++){
+        complete_request(fd, requests[i], 0);
     }
 }
 
-void set_paths(vector<string> &paths, const char *curr_path){
-    // curr_path is the full path name
-    // either /a/b/c or b/c. 
-    int END_REACHED = 0;
-    int is_absolute = (curr_path[0] == '/');
+class Fd_Streambuf : public streambuf{
+    // Stream buffer that writes to a descriptor, formatted output of a server session and of batch mode go through it
+    int fd;
+    vector<char> buffer;
 
-    string path = "";
-    int i = 0;
-    if(is_absolute){
-        i++;
+    int write_all(const char *data, size_t size){
+        while(size > 0){
+            ssize_t w = write(fd, data, size);
+            if(w < 0 && errno == EINTR){
+                continue;
+            }
+            if(w <= 0){
+                return -1;
+            }
+            data += w;
+            size -= w;
+        }
+        return 0;
     }
-    while(!END_REACHED){
-        if(curr_path[i] == '\0'){
-            END_REACHED = 1;
+
+    int drain(){
+        int result = write_all(pbase(), pptr() - pbase());
+        setp(buffer.data(), buffer.data() + buffer.size());
+        return result;
+    }
+
+    protected:
+        int overflow(int c){
+            if(drain() == -1){
+                return EOF;
+            }
+            if(c != EOF){
+                *pptr() = c;
+                pbump(1);
+            }
+            return c == EOF ? 0 : c;
         }
-        else if(curr_path[i] == '/'){
-            //cout << "Path added : " << path << endl;
-            paths.push_back(path);
-            path = "";
+
+        int sync(){
+            return drain();
         }
-        else{
-            path += curr_path[i];
+
+        streamsize xsputn(const char *data, streamsize size){
+            // Data that does not fit is written after the buffered part, without copying it if it is large
+            if(size > epptr() - pptr()){
+                if(drain() == -1){
+                    return 0;
+                }
+                if(size >= epptr() - pbase()){
+                    return write_all(data, size) == -1 ? 0 : size;
+                }
+            }
+            memcpy(pptr(), data, size);
+            pbump(size);
+            return size;
         }
-        i++;
-    }
-    //cout << "Path added : " << path << endl;
-    paths.push_back(path);
-}
 
-void set_current_parent(void * clstr_ptr, int &cur_clus){
-    // Basic pointer calculation. Second Fat83 entry 
-    // in a cluster is the parent directory entry.
-    FatFile83* cluster83 = (FatFile83 *) clstr_ptr;
-    FatFile83 parent_entry = *(cluster83 + 1);
-    
-    // Now we have the entry, find its first cluster
-    // eaIndex << 16 | last16Bit
-    cur_clus = parent_entry.eaIndex << 16 | parent_entry.firstCluster;
+    public:
+        Fd_Streambuf(int fd_, size_t size = 4096) : fd(fd_), buffer(size){
+            setp(buffer.data(), buffer.data() + buffer.size());
+        }
+};
 
-    if(cur_clus == 0){
-        cur_clus = 2;
-    }
+struct Output_Sink{ // Where the commands of a thread write, a server session points it to its socket
+    int fd = STDOUT_FILENO; // Large writes of write_output
+    ostream *stream = &cout; // Formatted output
+    int buffered = 0; // Set in batch mode, everything goes through stream and it is flushed only when it is full
+};
 
+thread_local Output_Sink output_sink;
+
+ostream &output_stream(){
+    return *output_sink.stream;
 }
 
-int cd_(string &destination,string &starting_directory, int &starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
-    // Implementation of CD command. CD takes exactly one argument.
+class FAT_Block{
     /*
-    1: procedure CD(path)
-        2: Locate(path)
-        3: if returns error then
-            4: Return
-        5: else
-            6: Record return info for future use
-            7: Update prompt
-            8: Return
-        9: end if
-    10: end procedure
+        Structure for the FAT block in the file system.
+        To read a block, we have to open a file with descriptor fd.
+        BPB_struct will be assigne throughout this process.
+        The first FAT is loaded into fat_table once at the construction. Lookups are done
+        on this table and modified sectors are marked in dirty_sectors. They are written back
+        to every FAT copy when flush is called (on sync and quit).
+        Free clusters are kept in free_clusters bitmap (bit is set if the cluster is free) so that
+        allocation does not scan the FAT. Search starts from next_free, which is taken from and
+        written back to the FSInfo sector.
+        If image_map is given, the whole image is mapped into the memory and
+        FAT is read and written through the mapping instead of pread/pwrite.
     */
+    BPB_struct bpb; // Holds the information about BPB.
+    int fd = -1;
+    char *image_map = NULL; // Start of the mapped image, NULL if the image is not mapped
+    uint64_t fat_start_offset; // Reserved sector should be skipped to reach the offset
+
+    vector<uint32_t> fat_table; // In-memory copy of the first FAT
+    vector<uint64_t> dirty_sectors; // One bit for each sector of the FAT, set if the sector is modified
+    unsigned int entries_per_sector;
+
+    vector<uint64_t> free_clusters; // One bit for each cluster, set if the cluster is free
+    unsigned int cluster_limit; // Clusters are in the range [2, cluster_limit)
+    unsigned int free_count = 0;
+    unsigned int next_free = ROOT_DIRECTORY; // Allocation hint
+    char fsinfo_sector[BPS]; // FSInfo sector, valid only if has_fsinfo
+    int has_fsinfo = 0;
+    recursive_mutex allocation_lock; // Allocation and FAT updates of the sessions are serialized
+    int defer_frees = 0; // Set in journal mode, freed clusters are not given again until the next commit
+    vector<int> deferred_frees;
+    
+    public:
+        FAT_Block(BPB_struct &bpb_, int fd_, char *image_map_ = NULL){ // Can construct a FAT_block structure if we have bpb. Also provide file descriptor
+                                              // so that we can read from a fat block as well.
+            bpb = bpb_;                 
+            fd = fd_;
+            image_map = image_map_;
+            set_start_offset();
+            load_fat_table();
+            load_fsinfo();
+            build_free_bitmap();
+        }
 
-    string current_path = starting_directory;
-    vector<string> paths;
+        // Set- get method defined for the offset
+        void set_start_offset(){
+            uint16_t bps = bpb.BytesPerSector;
+            uint16_t rsc = bpb.ReservedSectorCount;
+            fat_start_offset = (uint64_t) bps*rsc;
+        }
 
-    int current_cluster = starting_cluster;
-    int DESTINATION_NOT_REACHED = 1;
-    int path_count = 0;
-    int total_fat_entries = dblock.get_cluster_size() / sizeof(FatFile83);
-    // Set current cluster and path with respect to the whether path is absolute or not
-    set_starting_cluster(current_cluster, destination.c_str());
-    set_starting_directory(current_path, destination.c_str());
-
-    //cout << "Currents : " << current_path << current_cluster  << endl;
-    // Parse path into set of directories for traversing
-    set_paths(paths, destination.c_str()); // example : paths/testdir/dir -> {"paths","testdir","dir"}
-                                            // /paths/test/dir -> paths test dir as well
-    //cout << "Patrh length : " << paths.size() << endl;
-    while(DESTINATION_NOT_REACHED && path_count < paths.size()){
-        string next_path = paths[path_count];
-
-        //cout << "Target is :" << next_path << endl;
-        if(next_path == "."){ // Do nothing
-            path_count++;
-            continue;
+        uint64_t get_start_offset(){
+            return fat_start_offset;
         }
-        else if(next_path == ".."){
-            // Must find the parent. If root, return error
-            if(current_path == "/"){
-                //std::cout << "Root has no parent" << std::endl;
-                DESTINATION_NOT_REACHED = 0;
-                path_count++;
-                continue;
-            }
 
-            // Read the current block. 
-            void *cluster_pointer = dblock.get_from_dblock(current_cluster);
-            set_current_parent(cluster_pointer, current_cluster);
-            //cout << "Parent is set" << current_cluster << endl;
-            // Update current path
-            // a/b/c -> a/b so we have to remove /c
-            int BACKSLASH_DETECTED = 0;
-            while(!BACKSLASH_DETECTED){
-                //cout << current_path << endl;
-                char last = current_path.back();
-
-                if(last == '/'){    
-                    BACKSLASH_DETECTED = 1;
-                    if(current_cluster != 2){
-                        current_path.pop_back();
-                    }
-                }
-                else{
-                    current_path.pop_back();
-                    }
-            }
+        uint64_t get_fat_table_size(){
+            return (uint64_t) bpb.BytesPerSector * bpb.extended.FATSize;
+        }
 
-            //cout << current_path << endl;
-            path_count++;
-            continue;
+        unsigned int get_entry_count(){ // Number of entries that the FAT can hold
+            return fat_table.size();
+        }
 
+        unsigned int get_cluster_limit(){ // Clusters are in the range [2, cluster_limit)
+            return cluster_limit;
         }
-        else{  // Else, traverse the all cluster and check
-               // each entries and the target path.
-               // LFN comes first!
-            int break_loop = 0;
-            vector<FatFileLFN*> lfn_vec;
 
-            for(int traverse_cluster = current_cluster; traverse_cluster < END_CLUSTER; traverse_cluster = fblock.get_from_fat(traverse_cluster)){
-                void *cluster_pointer = dblock.get_from_dblock(traverse_cluster);
-                // LFN entries come first.
-                int i = 0;
-                for(; i < total_fat_entries; i++){    
-                    // If not the root, we have to start from 2, else start from 0
-                    FatFileLFN* traverse_pointer = (FatFileLFN *) cluster_pointer;
-                    traverse_pointer += i;
+        int get_fat_count(){
+            return bpb.NumFATs;
+        }
 
-                    if(traverse_pointer->sequence_number == 0x00){
-                        free(cluster_pointer);
-                        return -1;
-                    }
-                    else if(traverse_pointer->sequence_number == 0xE5){
-                        continue;
-                    }
+        unsigned int get_fat_sector_count(){
+            return bpb.extended.FATSize;
+        }
 
-                   else if(traverse_pointer->sequence_number == 0x2E){
+        uint64_t compare_fat_copy(int copy, unsigned int first_sector, unsigned int sector_count){
+            // Compare the sectors of a FAT copy on the image with the in-memory table.
+            // Returns the number of sectors that differ. Only reads, so it can be called from other threads.
+            unsigned int bps = bpb.BytesPerSector;
+            vector<char> sector(bps);
+            uint64_t mismatched = 0;
+            for(unsigned int i = first_sector; i < first_sector + sector_count; i++){
+                uint64_t offset = get_start_offset() + (uint64_t) copy * get_fat_table_size() + (uint64_t) i * bps;
+                const char *data;
+                if(image_map){
+                    data = image_map + offset;
+                }
+                else{
+                    if(count_io(pread(fd, sector.data(), bps, offset), IO_READ) != bps){
+                        mismatched++;
                         continue;
                     }
-                    lfn_vec.push_back(traverse_pointer);
-                    int next_true_entry = (static_cast<int>(traverse_pointer->sequence_number) == 1) || (static_cast<int>(traverse_pointer->sequence_number) == 65);
-                    //cout << " i : " << i << " lfn "  << next_true_entry << endl; 
-                    if(next_true_entry){
-                        //Now we are at true FatFile83 directory entry
-                        //Extract the name from the stack
-                        // Concatanate them to get the filneame
-                        // Compare it with the target
-                        // If true, calculate the next cluster index
-                        // Go to that cluster and continue looping!
-                        FatFile83 *true_entry = (FatFile83 *) cluster_pointer;
-                        i++;
-                        true_entry += i;
-                        //true_entry += (i+1);
-                        string concat_file_name = "";
-                        next_true_entry = 0;
-                        int end_reached = 0;
-
-                        //cout << " --> " << lfn_vec.size() << endl;
-                        for(int i2 = 1; i2 < lfn_vec.size(); i2++){
-                            FatFileLFN* dummy = lfn_vec[i2];
-                            for(int j = 0; j < 5; j++){
-                                if(dummy->name1[j] == '\0'){
-                                    end_reached = 1;
-                                }   
-                                if(end_reached){
-                                    break;
-                                }
-                                concat_file_name += dummy->name1[j]; 
-
-                            }
-                            for(int j = 0; j < 6; j++){
-                                if(dummy->name2[j] == '\0'){
-                                    end_reached = 1;
-                                }   
-                                if(end_reached){
-                                    break;
-                                }    
-                                concat_file_name += dummy->name2[j];    
-                            }
-                            for(int j = 0; j < 2; j++){
-                                if(dummy->name3[j] == '\0'){
-                                    end_reached = 1;
-                                }   
-                                if(end_reached){
-                                    break;
-                                }   
-                                concat_file_name += dummy->name3[j];    
-                            }
-                        }
-                        FatFileLFN* dummy = lfn_vec[0];
-                        for(int j = 0; j < 5; j++){ 
-                            if(dummy->name1[j] == '\0'){
-                                end_reached = 1;
-                            }   
-                            if(end_reached){
-                                break;
-                            } 
-                            concat_file_name += dummy->name1[j];    
-                        }
-
-                        for(int j = 0; j < 6; j++){
-                            if(dummy->name2[j] == '\0'){
-                                end_reached = 1;
-                            }   
-                            if(end_reached){
-                                break;
-                            } 
-                            concat_file_name += dummy->name2[j];    
-                        }
-
-                        for(int j = 0; j < 2; j++){
-                            if(dummy->name3[j] == '\0'){
-                                end_reached = 1;
-                            }   
-                            if(end_reached){
-                                break;
-                            } 
-                            concat_file_name += dummy->name3[j];    
-                        }
-
-                        while(lfn_vec.size()){ // remove each element
-                            lfn_vec.pop_back();
-                        }
-
-                        //cout  << concat_file_name << " vs " << next_path << endl;
-                        if(concat_file_name == next_path){
-                            current_cluster = (true_entry->eaIndex << 16) | true_entry->firstCluster;
+                    data = sector.data();
+                }
+                if(memcmp(data, (char *) fat_table.data() + (uint64_t) i * bps, bps)){
+                    mismatched++;
+                }
+            }
+            return mismatched;
+        }
 
-                            if(current_path != "/"){
-                                current_path += "/";
-                            }
-                            current_path += concat_file_name;
-                            break_loop = 1;
+        void mark_all_dirty(){ // Every sector is written to every FAT copy on the next flush
+            unsigned int sector_count = bpb.extended.FATSize;
+            for(unsigned int sector = 0; sector < sector_count; sector++){
+                dirty_sectors[sector / 64] |= (uint64_t) 1 << (sector % 64);
+            }
+        }
 
-                        }
+        void load_fat_table(){
+            uint64_t table_size = get_fat_table_size();
+            fat_table.resize(table_size / INTS);
+            entries_per_sector = bpb.BytesPerSector / INTS;
+            dirty_sectors.assign((bpb.extended.FATSize + 63) / 64, 0);
 
-                    }
-                    if(break_loop){
-                        break;
-                    }
-                }
-                if(break_loop){
+            if(image_map){
+                memcpy(fat_table.data(), image_map + get_start_offset(), table_size);
+                return;
+            }
+            char *dest = (char *) fat_table.data();
+            uint64_t done = 0;
+            while(done < table_size){ // pread may return less than requested on large tables
+                ssize_t r = count_io(pread(fd, dest + done, table_size - done, get_start_offset() + done), IO_READ);
+                if(r <= 0){
                     break;
                 }
+                done += r;
             }
         }
 
-        path_count++;
-        if(path_count == paths.size()) {
-            DESTINATION_NOT_REACHED = 0;
+        void load_fsinfo(){
+            uint64_t fsinfo_offset = (uint64_t) bpb.extended.FSInfo * bpb.BytesPerSector;
+            if(bpb.extended.FSInfo == 0 || bpb.extended.FSInfo == 0xFFFF){
+                return;
+            }
+            if(image_map){
+                memcpy(fsinfo_sector, image_map + fsinfo_offset, BPS);
+            }
+            else if(count_io(pread(fd, fsinfo_sector, BPS, fsinfo_offset), IO_READ) != BPS){
+                return;
+            }
+            uint32_t lead_sig, struct_sig, hint;
+            memcpy(&lead_sig, fsinfo_sector, 4);
+            memcpy(&struct_sig, fsinfo_sector + 484, 4);
+            memcpy(&hint, fsinfo_sector + FSINFO_NEXT_FREE, 4);
+            if(lead_sig != FSINFO_LEAD_SIG || struct_sig != FSINFO_STRUCT_SIG){
+                return;
+            }
+            has_fsinfo = 1;
+            next_free = hint; // 0xFFFFFFFF means unknown, checked in build_free_bitmap
         }
-    }
-    starting_cluster = current_cluster;
-    starting_directory = current_path;
-    return 0;
 
-}
+        void build_free_bitmap(){
+            // Number of clusters is found from the sectors that remain after the FATs
+            uint32_t total_sectors = bpb.TotalSectors16 ? bpb.TotalSectors16 : bpb.TotalSectors32;
+            uint32_t data_sector = bpb.ReservedSectorCount + bpb.NumFATs * bpb.extended.FATSize;
+            uint32_t cluster_count = total_sectors > data_sector ? (total_sectors - data_sector) / bpb.SectorsPerCluster : 0;
 
+            cluster_limit = cluster_count + 2;
+            if(cluster_limit > fat_table.size()){
+                cluster_limit = fat_table.size();
+            }
+            free_clusters.assign((cluster_limit + 63) / 64, 0);
+            free_count = 0;
+            for(unsigned int i = ROOT_DIRECTORY; i < cluster_limit; i++){
+                if((fat_table[i] & 0x0fffffff) == 0){
+                    free_clusters[i / 64] |= (uint64_t) 1 << (i % 64);
+                    free_count++;
+                }
+            }
+            if(next_free < ROOT_DIRECTORY || next_free >= cluster_limit){
+                next_free = ROOT_DIRECTORY;
+            }
+        }
+
+        unsigned int get_free_count(){
+            lock_guard<recursive_mutex> lock(allocation_lock);
+            return free_count;
+        }
+
+        int allocate_cluster(){
+            // Find the first free cluster starting from next_free, wrap around once.
+            // The found cluster is marked as end of chain so it is not given again.
+            lock_guard<recursive_mutex> lock(allocation_lock);
+            if(free_count == 0){
+                return -1;
+            }
+            io_stats.allocations++;
+            unsigned int word_count = free_clusters.size();
+            unsigned int word = next_free / 64;
+            uint64_t bits = free_clusters[word] & (~(uint64_t) 0 << (next_free % 64)); // skip the ones before hint
+            for(unsigned int step = 0; step <= word_count; step++){
+                if(bits){
+                    int cluster = word * 64 + __builtin_ctzll(bits);
+                    write_to_fat(cluster, END_CLUSTER);
+                    next_free = cluster + 1 < cluster_limit ? cluster + 1 : ROOT_DIRECTORY;
+                    return cluster;
+                }
+                word = (word + 1) % word_count;
+                bits = free_clusters[word];
+            }
+            return -1;
+        }
+
+        int find_free_run(unsigned int from, unsigned int to, unsigned int count){
+            // First cluster of count consecutive free clusters in [from, to), -1 if there is no such run.
+            // Words that are completely used or completely free are handled at once.
+            lock_guard<recursive_mutex> lock(allocation_lock);
+            unsigned int run_start = from;
+            unsigned int run_length = 0;
+            unsigned int cluster = from;
+            while(cluster < to){
+                uint64_t word = free_clusters[cluster / 64];
+                if(cluster % 64 == 0 && cluster + 64 <= to && (word == 0 || word == ~(uint64_t) 0)){
+                    if(word == 0){
+                        run_length = 0;
+                    }
+                    else{
+                        if(run_length == 0){
+                            run_start = cluster;
+                        }
+                        run_length += 64;
+                    }
+                    cluster += 64;
+                }
+                else{
+                    if(word >> (cluster % 64) & 1){
+                        if(run_length == 0){
+                            run_start = cluster;
+                        }
+                        run_length++;
+                    }
+                    else{
+                        run_length = 0;
+                    }
+                    cluster++;
+                }
+                if(run_length >= count){
+                    return run_start;
+                }
+            }
+            return -1;
+        }
+
+        int allocate_chain(unsigned int count, vector<int> &clusters){
+            // Allocate count clusters and link them as a chain with a single batch of FAT updates.
+            // A contiguous run is used if there is one, otherwise clusters are taken one by one.
+            // Returns -1 if there is not enough free clusters.
+            lock_guard<recursive_mutex> lock(allocation_lock);
+            if(count == 0 || count > free_count){
+                return -1;
+            }
+            int run_start = find_free_run(next_free, cluster_limit, count);
+            if(run_start == -1){
+                run_start = find_free_run(ROOT_DIRECTORY, cluster_limit, count);
+            }
+            clusters.clear();
+            if(run_start != -1){
+                for(unsigned int i = 0; i < count; i++){
+                    clusters.push_back(run_start + i);
+                }
+                io_stats.allocations += count;
+                next_free = run_start + count < cluster_limit ? run_start + count : ROOT_DIRECTORY;
+            }
+            else{
+                for(unsigned int i = 0; i < count; i++){
+                    clusters.push_back(allocate_cluster());
+                }
+            }
+            write_chain(clusters);
+            return 0;
+        }
+
+        void write_chain(vector<int> &clusters){ // Link the clusters in the given order, last one is the end of chain
+            lock_guard<recursive_mutex> lock(allocation_lock);
+            for(int i = 0; i < clusters.size(); i++){
+                write_to_fat(clusters[i], i + 1 < clusters.size() ? clusters[i + 1] : END_CLUSTER);
+            }
+        }
+
+        unsigned int free_chains(const vector<int> &first_clusters){
+            // Free every cluster of the chains in one pass under the allocation lock. Entries are cleared in the
+            // table and the free bitmap directly, a sector that holds entries of many chains is written once on
+            // the next flush. In journal mode the clusters are deferred like in write_to_fat.
+            // A chain stops at an entry that is already free, so a broken chain is not followed into others.
+            // Returns the number of clusters freed.
+            lock_guard<recursive_mutex> lock(allocation_lock);
+            unsigned int freed = 0;
+            for(int i = 0; i < first_clusters.size(); i++){
+                unsigned int cluster = first_clusters[i];
+                while(cluster >= ROOT_DIRECTORY && cluster < cluster_limit){
+                    unsigned int next = fat_table[cluster] & 0x0fffffff;
+                    if(next == 0){
+                        break;
+                    }
+                    fat_table[cluster] = 0;
+                    unsigned int sector = cluster / entries_per_sector;
+                    dirty_sectors[sector / 64] |= (uint64_t) 1 << (sector % 64);
+                    if(defer_frees){
+                        deferred_frees.push_back(cluster);
+                    }
+                    else{
+                        free_clusters[cluster / 64] |= (uint64_t) 1 << (cluster % 64);
+                        free_count++;
+                    }
+                    freed++;
+                    cluster = next;
+                }
+            }
+            return freed;
+        }
+
+        void write_to_fat(int index, int value){ 
+            // Only the in-memory table is updated here, sector is written to each FAT copy on flush
+            lock_guard<recursive_mutex> lock(allocation_lock);
+            if(index >= ROOT_DIRECTORY && index < cluster_limit){ // keep the free bitmap in sync
+                uint64_t bit = (uint64_t) 1 << (index % 64);
+                int was_free = (free_clusters[index / 64] & bit) != 0;
+                int is_free = (value & 0x0fffffff) == 0;
+                if(is_free && !was_free && defer_frees){
+                    deferred_frees.push_back(index); // released by release_deferred
+                }
+                else if(is_free && !was_free){
+                    free_clusters[index / 64] |= bit;
+                    free_count++;
+                }
+                else if(!is_free && was_free){
+                    free_clusters[index / 64] &= ~bit;
+                    free_count--;
+                }
+            }
+            fat_table[index] = value;
+            unsigned int sector = index / entries_per_sector;
+            dirty_sectors[sector / 64] |= (uint64_t) 1 << (sector % 64);
+            return;
+        }
+
+        unsigned int get_from_fat(int index){
+            fat_lookup_counter.value++;
+		    return fat_table[index] & 0x0fffffff; // upper 4 bits should be masked since in FAT32 -> 28 bytes are used for
+										    // each cluster
+        }
+
+        void collect_writes(vector<Io_Request> &requests){
+            // Requests that write the dirty sectors to every FAT copy and the FSInfo sector.
+            // Consecutive dirty sectors are one request. Data of the requests points into the table.
+            lock_guard<recursive_mutex> lock(allocation_lock);
+            unsigned int sector_count = bpb.extended.FATSize;
+            unsigned int bps = bpb.BytesPerSector;
+            unsigned int sector = 0;
+            while(sector < sector_count){
+                if(!(dirty_sectors[sector / 64] >> (sector % 64) & 1)){
+                    sector++;
+                    continue;
+                }
+                unsigned int run_start = sector;
+                while(sector < sector_count && (dirty_sectors[sector / 64] >> (sector % 64) & 1)){
+                    sector++;
+                }
+                char *run_data = (char *) fat_table.data() + (uint64_t) run_start * bps;
+                uint64_t run_size = (uint64_t) (sector - run_start) * bps;
+
+                // Since there can be multiple file allocation table, update the sectors for (FAT table times)
+                uint64_t true_offset = get_start_offset() + (uint64_t) run_start * bps;
+                for(int i = 0; i < bpb.NumFATs; i++){
+                    Io_Request request;
+                    request.direction = IO_WRITE;
+                    request.offset = true_offset;
+                    request.vectors.push_back({run_data, run_size});
+                    requests.push_back(request);
+                    // Update the offset by skippnig a fat table size
+                    true_offset += get_fat_table_size();
+                }
+            }
+            if(has_fsinfo){ // free count and next free hint
+                uint32_t count = free_count;
+                uint32_t hint = next_free;
+                memcpy(fsinfo_sector + FSINFO_FREE_COUNT, &count, 4);
+                memcpy(fsinfo_sector + FSINFO_NEXT_FREE, &hint, 4);
+                Io_Request request;
+                request.direction = IO_WRITE;
+                request.offset = (uint64_t) bpb.extended.FSInfo * bpb.BytesPerSector;
+                request.vectors.push_back({fsinfo_sector, BPS});
+                requests.push_back(request);
+            }
+        }
+
+        void flush(){
+            // Write the dirty sectors to every FAT copy and the FSInfo sector back to the image
+            lock_guard<recursive_mutex> lock(allocation_lock);
+            vector<Io_Request> requests;
+            collect_writes(requests);
+            if(image_map){
+                for(int i = 0; i < requests.size(); i++){
+                    memcpy(image_map + requests[i].offset, requests[i].vectors[0].iov_base, requests[i].vectors[0].iov_len);
+                }
+            }
+            else{
+                run_requests(fd, requests); // the runs of all copies are written as one batch
+            }
+            dirty_sectors.assign(dirty_sectors.size(), 0);
+        }
+
+        void set_deferred_frees(int enabled){
+            lock_guard<recursive_mutex> lock(allocation_lock);
+            defer_frees = enabled;
+        }
+
+        void release_deferred(){
+            // Freed clusters can be allocated again once the change that freed them is on the image.
+            // A cluster that is used again in the meantime stays used.
+            lock_guard<recursive_mutex> lock(allocation_lock);
+            for(int i = 0; i < deferred_frees.size(); i++){
+                int index = deferred_frees[i];
+                uint64_t bit = (uint64_t) 1 << (index % 64);
+                if((fat_table[index] & 0x0fffffff) == 0 && !(free_clusters[index / 64] & bit)){
+                    free_clusters[index / 64] |= bit;
+                    free_count++;
+                }
+            }
+            deferred_frees.clear();
+        }
+
+};
+
+struct Cluster_Buffer{
+    int index; // Cluster index
+    vector<char> data;
+    int pin_count = 0; // Number of handles that use this buffer. Pinned buffers are not evicted.
+    int dirty = 0; // Set if the buffer is modified and not written back yet
+    list<Cluster_Buffer*>::iterator lru_position;
+};
+
+class Cluster_Cache;
+
+class Cluster_Handle{
+    /*
+        A pinned reference to a cluster. While the handle is alive, the cluster
+        stays in the memory and data() can be used. Pin is dropped when the handle is destroyed.
+        If the image is mapped, handle points into the mapping and buffer is NULL.
+    */
+    Cluster_Cache *cache = NULL;
+    Cluster_Buffer *buffer = NULL;
+    char *cluster_ptr = NULL;
+
+    public:
+        Cluster_Handle(){}
+        Cluster_Handle(Cluster_Cache *cache_, Cluster_Buffer *buffer_, char *cluster_ptr_){
+            cache = cache_;
+            buffer = buffer_;
+            cluster_ptr = cluster_ptr_;
+        }
+        Cluster_Handle(const Cluster_Handle &) = delete;
+        Cluster_Handle& operator=(const Cluster_Handle &) = delete;
+        Cluster_Handle(Cluster_Handle &&other){
+            cache = other.cache;
+            buffer = other.buffer;
+            cluster_ptr = other.cluster_ptr;
+            other.buffer = NULL;
+        }
+        Cluster_Handle& operator=(Cluster_Handle &&other){
+            if(this != &other){
+                release();
+                cache = other.cache;
+                buffer = other.buffer;
+                cluster_ptr = other.cluster_ptr;
+                other.buffer = NULL;
+            }
+            return *this;
+        }
+        ~Cluster_Handle(){
+            release();
+        }
+
+        void *data(){
+            return cluster_ptr;
+        }
+        void mark_dirty();
+        void release();
+};
+
+class Cluster_Cache{
+    /*
+        Bounded LRU cache of clusters. Buffers are kept in lru list (most recently used at the front).
+        When the total size exceeds the budget, unpinned buffers are evicted from the back.
+        Dirty buffers are written back on eviction or on flush. If keep_dirty is set (journal mode),
+        dirty buffers are not evicted, they are written only after the journal has them.
+        The map and the list are guarded by cache_lock, so sessions of the server can share the cache.
+        Contents of a pinned buffer are guarded by the lock of the directory it belongs to.
+    */
+    int fd = -1;
+    uint64_t data_start_offset = 0;
+    unsigned int cluster_size = 0;
+    size_t max_buffers = 0;
+
+    unordered_map<int, Cluster_Buffer*> buffers;
+    list<Cluster_Buffer*> lru;
+    mutex cache_lock;
+    size_t dirty_count = 0; // Number of dirty buffers
+    int keep_dirty = 0;
+
+    public:
+        Cluster_Cache(){}
+        Cluster_Cache(const Cluster_Cache &) = delete;
+        Cluster_Cache& operator=(const Cluster_Cache &) = delete;
+        ~Cluster_Cache(){
+            for(auto &it : buffers){
+                delete it.second;
+            }
+        }
+
+        void init(int fd_, uint64_t data_start_offset_, unsigned int cluster_size_, size_t budget){
+            fd = fd_;
+            data_start_offset = data_start_offset_;
+            cluster_size = cluster_size_;
+            max_buffers = budget / cluster_size;
+            if(max_buffers < 4){ // A few clusters should always fit
+                max_buffers = 4;
+            }
+        }
+
+        uint64_t get_cluster_offset(int index){
+            return data_start_offset + (uint64_t) (index - 2) * cluster_size; // root starts from cluster index 2
+        }
+
+        void set_keep_dirty(int enabled){
+            lock_guard<mutex> lock(cache_lock);
+            keep_dirty = enabled;
+        }
+
+        size_t get_dirty_count(){
+            lock_guard<mutex> lock(cache_lock);
+            return dirty_count;
+        }
+
+        size_t get_capacity(){ // Number of buffers that fit in the budget
+            return max_buffers;
+        }
+
+        Cluster_Handle pin(int index, int read_from_disk){
+            // Find the cluster in the cache, read it if it does not exist.
+            // If read_from_disk is 0, the caller overwrites the whole cluster so reading is skipped.
+            lock_guard<mutex> lock(cache_lock);
+            Cluster_Buffer *buffer;
+            auto found = buffers.find(index);
+            if(found != buffers.end()){
+                buffer = found->second;
+                lru.splice(lru.begin(), lru, buffer->lru_position);
+                io_stats.cache_hits++;
+            }
+            else{
+                io_stats.cache_misses++;
+                evict(max_buffers - 1);
+                buffer = new Cluster_Buffer();
+                buffer->index = index;
+                buffer->data.resize(cluster_size);
+                if(read_from_disk){
+                    count_io(pread(fd, buffer->data.data(), cluster_size, get_cluster_offset(index)), IO_READ);
+                    io_stats.cluster_reads++;
+                }
+                lru.push_front(buffer);
+                buffer->lru_position = lru.begin();
+                buffers[index] = buffer;
+            }
+            buffer->pin_count++;
+            return Cluster_Handle(this, buffer, buffer->data.data());
+        }
+
+        void unpin(Cluster_Buffer *buffer){
+            lock_guard<mutex> lock(cache_lock);
+            buffer->pin_count--;
+        }
+
+        void mark_dirty(Cluster_Buffer *buffer){
+            lock_guard<mutex> lock(cache_lock);
+            if(!buffer->dirty){
+                buffer->dirty = 1;
+                dirty_count++;
+            }
+        }
+
+        void write_back(Cluster_Buffer *buffer){
+            if(buffer->dirty){
+                count_io(pwrite(fd, buffer->data.data(), cluster_size, get_cluster_offset(buffer->index)), IO_WRITE);
+                io_stats.cluster_writes++;
+                buffer->dirty = 0;
+                dirty_count--;
+            }
+        }
+
+        void evict(size_t keep){
+            // Evict unpinned buffers from the least recently used side until at most keep buffers stay.
+            // cache_lock should be held by the caller.
+            auto it = lru.end();
+            while(buffers.size() > keep && it != lru.begin()){
+                --it;
+                Cluster_Buffer *buffer = *it;
+                if(buffer->pin_count > 0 || (keep_dirty && buffer->dirty)){
+                    continue;
+                }
+                write_back(buffer);
+                buffers.erase(buffer->index);
+                it = lru.erase(it);
+                delete buffer;
+            }
+        }
+
+        void copy_dirty(int index, int count, char *buffer){
+            // Overwrite the clusters in [index, index + count) that are modified in the cache but not written yet
+            lock_guard<mutex> lock(cache_lock);
+            if(buffers.size() < (size_t) count){
+                for(auto &it : buffers){
+                    Cluster_Buffer *cached = it.second;
+                    if(cached->dirty && cached->index >= index && cached->index < index + count){
+                        memcpy(buffer + (uint64_t) (cached->index - index) * cluster_size, cached->data.data(), cluster_size);
+                    }
+                }
+                return;
+            }
+            for(int i = 0; i < count; i++){
+                auto found = buffers.find(index + i);
+                if(found != buffers.end() && found->second->dirty){
+                    memcpy(buffer + (uint64_t) i * cluster_size, found->second->data.data(), cluster_size);
+                }
+            }
+        }
+
+        void discard(int index, int count){
+            // Clusters in [index, index + count) are written directly to the image, cached copies are outdated.
+            // Pinned buffers can not be removed, they are refreshed from the image instead.
+            lock_guard<mutex> lock(cache_lock);
+            for(auto it = lru.begin(); it != lru.end();){
+                Cluster_Buffer *cached = *it;
+                if(cached->index < index || cached->index >= index + count){
+                    ++it;
+                }
+                else if(cached->pin_count > 0){
+                    count_io(pread(fd, cached->data.data(), cluster_size, get_cluster_offset(cached->index)), IO_READ);
+                    io_stats.cluster_reads++;
+                    dirty_count -= cached->dirty;
+                    cached->dirty = 0;
+                    ++it;
+                }
+                else{
+                    dirty_count -= cached->dirty;
+                    buffers.erase(cached->index);
+                    it = lru.erase(it);
+                    delete cached;
+                }
+            }
+        }
+
+        void collect_writes(vector<Io_Request> &requests){
+            // Requests that write all dirty buffers, buffers stay dirty. Data of the requests points into the buffers.
+            lock_guard<mutex> lock(cache_lock);
+            gather_dirty(requests);
+        }
+
+        void flush(){
+            // Write all dirty buffers, the requests of all runs are done as one batch
+            lock_guard<mutex> lock(cache_lock);
+            vector<Io_Request> requests;
+            gather_dirty(requests);
+            for(int i = 0; i < requests.size(); i++){
+                io_stats.cluster_writes += requests[i].vectors.size();
+            }
+            for(auto &it : buffers){
+                it.second->dirty = 0;
+            }
+            dirty_count = 0;
+            run_requests(fd, requests);
+        }
+
+    private:
+        void gather_dirty(vector<Io_Request> &requests){
+            // Dirty buffers are sorted so that consecutive clusters are written with one request.
+            // cache_lock should be held by the caller.
+            vector<Cluster_Buffer*> dirty_buffers;
+            for(auto &it : buffers){
+                if(it.second->dirty){
+                    dirty_buffers.push_back(it.second);
+                }
+            }
+            sort(dirty_buffers.begin(), dirty_buffers.end(), [](Cluster_Buffer *a, Cluster_Buffer *b){
+                return a->index < b->index;
+            });
+            size_t i = 0;
+            while(i < dirty_buffers.size()){
+                vector<struct iovec> run;
+                int run_start = dirty_buffers[i]->index;
+                while(i < dirty_buffers.size() && dirty_buffers[i]->index == run_start + (int) run.size() && run.size() < IOV_MAX){
+                    struct iovec vec;
+                    vec.iov_base = dirty_buffers[i]->data.data();
+                    vec.iov_len = cluster_size;
+                    run.push_back(vec);
+                    i++;
+                }
+                Io_Request request;
+                request.direction = IO_WRITE;
+                request.offset = get_cluster_offset(run_start);
+                request.vectors = std::move(run);
+                requests.push_back(std::move(request));
+            }
+        }
+};
+
+void Cluster_Handle::mark_dirty(){
+    if(buffer){
+        cache->mark_dirty(buffer);
+    }
+}
+
+void Cluster_Handle::release(){
+    if(buffer){
+        cache->unpin(buffer);
+        buffer = NULL;
+    }
+}
+
+#define READ_AHEAD_MIN 4 // Clusters prefetched when a chain is started
+#define READ_AHEAD_MAX 1024 // Largest prefetch window in clusters
+#define READ_AHEAD_QUEUE_LIMIT 256 // Older requests are dropped when more are waiting
+
+class Read_Ahead{
+    /*
+        Background thread that asks the kernel to bring ranges of the image into the page cache
+        with posix_fadvise(WILLNEED), so the reads that come after do not wait for the disk.
+        Prefetching is only a hint, if the thread falls behind the oldest requests are dropped.
+        The thread is started with the first request.
+    */
+    int fd = -1;
+    deque<pair<uint64_t,uint64_t>> requests; // offset and length
+    mutex request_lock;
+    condition_variable request_added;
+    int stopping = 0;
+    thread worker;
+
+    void prefetch_loop(){
+        while(1){
+            pair<uint64_t,uint64_t> request;
+            {
+                unique_lock<mutex> lock(request_lock);
+                request_added.wait(lock, [this]{ return !requests.empty() || stopping; });
+                if(stopping){
+                    return;
+                }
+                request = requests.front();
+                requests.pop_front();
+            }
+            posix_fadvise(fd, request.first, request.second, POSIX_FADV_WILLNEED);
+            io_stats.prefetches++;
+        }
+    }
+
+    public:
+        void init(int fd_){
+            fd = fd_;
+        }
+
+        void submit(uint64_t offset, uint64_t length){
+            {
+                lock_guard<mutex> lock(request_lock);
+                if(!worker.joinable()){
+                    worker = thread(&Read_Ahead::prefetch_loop, this);
+                }
+                requests.push_back(make_pair(offset, length));
+                if(requests.size() > READ_AHEAD_QUEUE_LIMIT){
+                    requests.pop_front();
+                }
+            }
+            request_added.notify_one();
+        }
+
+        ~Read_Ahead(){
+            {
+                lock_guard<mutex> lock(request_lock);
+                stopping = 1;
+            }
+            request_added.notify_one();
+            if(worker.joinable()){
+                worker.join();
+            }
+        }
+};
+
+class DATA_Block{
+    /*
+        Structure for reading or writing on the DATA block in the FAT filesystem.
+        If image_map is given, clusters are returned as pointers into the mapped image
+        so no copy is made. Otherwise, clusters are kept in an LRU cache and a pinned
+        handle to the cached buffer is returned. Modified clusters are written back on
+        eviction or on flush.
+    */
+    BPB_struct bpb; // Holds the information about BPB.
+    int fd = -1;
+    char *image_map = NULL; // Start of the mapped image, NULL if the image is not mapped
+    uint64_t data_start_offset = 0; // Reserved sector should be skipped to reach the offset
+    Cluster_Cache cache;
+    Read_Ahead read_ahead;
+    int journaled = 0; // Set in journal mode, dirty clusters are written by the journal commit only
+    atomic<int> data_written{0}; // Set when clusters are written directly, cleared by take_data_written
+
+    public:
+        DATA_Block(BPB_struct &bpb_, int fd_, char *image_map_ = NULL, size_t cache_budget = DEFAULT_CACHE_BUDGET){ // Can construct a FAT_block structure if we have bpb. Also provide file descriptor
+                                              // so that we can read from a fat block as well.
+            bpb = bpb_;                 
+            fd = fd_;
+            image_map = image_map_;
+            set_start_offset();
+            cache.init(fd, data_start_offset, get_cluster_size(), cache_budget);
+            read_ahead.init(fd);
+        }
+
+        void set_start_offset(){ // Set the offset where the datablock starts.
+            // Skip the reserved sectors
+            uint16_t bps = bpb.BytesPerSector;
+            uint16_t rsc = bpb.ReservedSectorCount;
+            data_start_offset += (uint64_t) bps*rsc;
+
+            // Skip the FAT sectors
+            uint32_t spf = bpb.extended.FATSize; // sector_per_fat
+            uint8_t nf = bpb.NumFATs; // num fats
+            data_start_offset += (uint64_t) spf * bps * nf;
+        }
+
+        uint64_t get_start_offset(){
+            return data_start_offset;
+        }
+
+        unsigned int get_cluster_size(){
+            uint16_t bps = bpb.BytesPerSector;
+            uint16_t spc = bpb.SectorsPerCluster;
+            return  bps * spc;
+        }
+
+        uint64_t get_cluster_offset(int index){
+            return get_start_offset() + (uint64_t) (index - 2) * get_cluster_size(); // root starts from cluster index 2
+        }
+
+        int get_fd(){
+            return fd;
+        }
+
+        void set_journaled(int enabled){
+            journaled = enabled;
+            cache.set_keep_dirty(enabled);
+        }
+
+        size_t get_dirty_count(){
+            return image_map ? 0 : cache.get_dirty_count();
+        }
+
+        size_t get_cache_capacity(){
+            return cache.get_capacity();
+        }
+
+        int take_data_written(){ // Returns 1 if clusters were written directly since the last call
+            return data_written.exchange(0);
+        }
+
+        void write_to_dblock(int index, void *data){ // *data should point to a cluster-sized data.
+            unsigned cluster_size = get_cluster_size();
+
+            uint64_t dblock_offset = get_cluster_offset(index);
+
+            if(image_map){
+                // data may already be the mapped cluster itself if it is taken from get_from_dblock
+                if(data != image_map + dblock_offset){
+                    memcpy(image_map + dblock_offset, data, cluster_size);
+                }
+                return;
+            }
+            // data may already be the cached buffer, otherwise it overwrites the whole cluster
+            Cluster_Handle cluster_handle = cache.pin(index, 0);
+            if(data != cluster_handle.data()){
+                memcpy(cluster_handle.data(), data, cluster_size);
+            }
+            cluster_handle.mark_dirty();
+        }
+
+        Cluster_Handle get_empty_cluster(int index){ // Cluster whose old contents are not needed, it is filled with zeros
+            Cluster_Handle cluster_handle = image_map ? Cluster_Handle(NULL, NULL, image_map + get_cluster_offset(index)) : cache.pin(index, 0);
+            memset(cluster_handle.data(), 0, get_cluster_size());
+            return cluster_handle;
+        }
+
+        Cluster_Handle get_from_dblock(int index){ // Basically, read the cluster
+            if(image_map){
+                return Cluster_Handle(NULL, NULL, image_map + get_cluster_offset(index)); // No copy, writes on it goes to the image directly
+            }
+            return cache.pin(index, 1);
+        }
+
+        void prefetch(int index, int count){ // Hint that count clusters from index will be read soon
+            read_ahead.submit(get_cluster_offset(index), (uint64_t) count * get_cluster_size());
+        }
+
+        char *get_mapped(int index){ // Pointer to the cluster in the mapping, NULL if the image is not mapped
+            if(image_map){
+                return image_map + get_cluster_offset(index);
+            }
+            return NULL;
+        }
+
+        void read_clusters(int index, int count, char *buffer){
+            // Read count consecutive clusters starting from index with a single request.
+            // buffer should hold count clusters. Clusters modified in the cache are taken from the cache.
+            load_clusters(index, count, buffer);
+            if(!image_map){
+                cache.copy_dirty(index, count, buffer);
+            }
+        }
+
+        void load_clusters(int index, int count, char *buffer){
+            // Read the clusters from the image without looking at the cache, so it can be called from other threads
+            vector<pair<int,int>> runs(1, make_pair(index, count));
+            load_runs(runs, buffer);
+        }
+
+        void read_runs(vector<pair<int,int>> &runs, char *buffer){
+            // Read the (first cluster, cluster count) runs one after another into buffer, taking the
+            // clusters modified in the cache from the cache
+            load_runs(runs, buffer);
+            if(!image_map){
+                for(int i = 0; i < runs.size(); i++){
+                    cache.copy_dirty(runs[i].first, runs[i].second, buffer);
+                    buffer += (uint64_t) runs[i].second * get_cluster_size();
+                }
+            }
+        }
+
+        void load_runs(vector<pair<int,int>> &runs, char *buffer){
+            // Read the runs into buffer without looking at the cache. The reads of all runs are one batch.
+            vector<Io_Request> requests;
+            for(int i = 0; i < runs.size(); i++){
+                io_stats.cluster_reads += runs[i].second;
+                uint64_t size = (uint64_t) runs[i].second * get_cluster_size();
+                uint64_t offset = get_cluster_offset(runs[i].first);
+                if(image_map){
+                    memcpy(buffer, image_map + offset, size);
+                }
+                else{
+                    Io_Request request;
+                    request.direction = IO_READ;
+                    request.offset = offset;
+                    request.vectors.push_back({buffer, size});
+                    requests.push_back(request);
+                }
+                buffer += size;
+            }
+            if(!requests.empty()){
+                run_requests(fd, requests);
+            }
+        }
+
+        void write_clusters(int index, int count, char *buffer){
+            // Write count consecutive clusters starting from index with a single request, bypassing the cache
+            store_clusters(index, count, buffer);
+            discard_cached(index, count);
+        }
+
+        void discard_cached(int index, int count){ // Drop the cached copies of the clusters that are written directly
+            if(!image_map){
+                cache.discard(index, count);
+            }
+        }
+
+        void store_clusters(int index, int count, const char *buffer){
+            // Write the clusters to the image without touching the cache, so it can be called from another thread.
+            // Cached copies should be discarded by the caller.
+            io_stats.cluster_writes += count;
+            uint64_t size = (uint64_t) count * get_cluster_size();
+            uint64_t offset = get_cluster_offset(index);
+            if(image_map){
+                memcpy(image_map + offset, buffer, size);
+                return;
+            }
+            vector<Io_Request> requests(1);
+            requests[0].direction = IO_WRITE;
+            requests[0].offset = offset;
+            requests[0].vectors.push_back({(char *) buffer, size});
+            run_requests(fd, requests);
+            data_written = 1;
+        }
+
+        void flush(){ // Write the dirty clusters back to the image, in journal mode the commit does it
+            if(!image_map && !journaled){
+                cache.flush();
+            }
+        }
+
+        void collect_writes(vector<Io_Request> &requests){ // Requests that would write the dirty clusters
+            if(!image_map){
+                cache.collect_writes(requests);
+            }
+        }
+
+        void write_back(){ // Write the dirty clusters even in journal mode, called once the journal has them
+            if(!image_map){
+                cache.flush();
+            }
+        }
+
+};
+
+class Chain_Prefetcher{
+    /*
+        Follows a cluster chain ahead of a reader. When the reader gets within half a window of
+        the prefetched part, the next window of the chain is given to the read-ahead thread as runs
+        of consecutive clusters. The window doubles each time, so long chains get large prefetches
+        while short ones cost nothing. The FAT is in memory, so looking ahead is cheap.
+    */
+    DATA_Block &dblock;
+    FAT_Block &fblock;
+    int next_cluster; // First cluster that is not prefetched yet
+    unsigned int ahead = 0; // Clusters prefetched but not read yet
+    unsigned int window = READ_AHEAD_MIN;
+
+    public:
+        Chain_Prefetcher(int first_cluster, DATA_Block &dblock_, FAT_Block &fblock_) : dblock(dblock_), fblock(fblock_){
+            // The first cluster is read right away, prefetching starts from the one after it
+            next_cluster = first_cluster >= ROOT_DIRECTORY && first_cluster < END_CLUSTER ? fblock.get_from_fat(first_cluster) : END_CLUSTER;
+            advance(0);
+        }
+
+        void advance(unsigned int consumed){ // Reader moved consumed clusters forward
+            ahead = consumed > ahead ? 0 : ahead - consumed;
+            if(ahead > window / 2){
+                return;
+            }
+            int run_start = -1;
+            int run_length = 0;
+            unsigned int collected = 0;
+            while(collected < window && next_cluster >= ROOT_DIRECTORY && next_cluster < END_CLUSTER){
+                if(run_length > 0 && next_cluster != run_start + run_length){
+                    dblock.prefetch(run_start, run_length);
+                    run_length = 0;
+                }
+                if(run_length == 0){
+                    run_start = next_cluster;
+                }
+                run_length++;
+                collected++;
+                next_cluster = fblock.get_from_fat(next_cluster);
+            }
+            if(run_length > 0){
+                dblock.prefetch(run_start, run_length);
+            }
+            ahead += collected;
+            window = window * 2 < READ_AHEAD_MAX ? window * 2 : READ_AHEAD_MAX;
+        }
+};
+
+// Directory entries and the name index.
+struct Dir_Record{
+    // Decoded directory entry and where it is stored in the directory chain
+    string name;
+    uint32_t first_cluster;
+    uint8_t attributes;
+    uint32_t file_size;
+    uint16_t modified_time;
+    uint16_t modified_date;
+    int entry_cluster; // Cluster and the index of the 8.3 entry
+    int entry_index;
+    int lfn_cluster; // Cluster and the index of the first LFN entry
+    int lfn_index;
+    int entry_count; // Number of LFN entries + 8.3 entry
+    int checksum_ok; // LFN entries hold the checksum of the 8.3 name
+};
+
+string decode_lfn_name(vector<FatFileLFN> &lfn_vec){
+    // Concatanate the names in the LFN run. First entry holds the last part of the name,
+    // the remaining entries come in order.
+    string concat_file_name = "";
+    int end_reached = 0;
+    for(int i2 = 1; i2 <= lfn_vec.size() && !end_reached; i2++){
+        FatFileLFN* dummy = &lfn_vec[i2 % lfn_vec.size()];
+        for(int j = 0; j < 5 && !end_reached; j++){
+            if(dummy->name1[j] == '\0'){
+                end_reached = 1;
+                break;
+            }
+            concat_file_name += dummy->name1[j];
+        }
+        for(int j = 0; j < 6 && !end_reached; j++){
+            if(dummy->name2[j] == '\0'){
+                end_reached = 1;
+                break;
+            }
+            concat_file_name += dummy->name2[j];
+        }
+        for(int j = 0; j < 2 && !end_reached; j++){
+            if(dummy->name3[j] == '\0'){
+                end_reached = 1;
+                break;
+            }
+            concat_file_name += dummy->name3[j];
+        }
+    }
+    return concat_file_name;
+}
+
+Dir_Record make_record(string name, FatFile83 *true_entry, int entry_cluster, int entry_index, int lfn_cluster, int lfn_index, int entry_count){
+    Dir_Record record;
+    record.name = name;
+    record.first_cluster = (true_entry->eaIndex << 16) | true_entry->firstCluster;
+    record.attributes = true_entry->attributes;
+    record.file_size = true_entry->fileSize;
+    record.modified_time = true_entry->modifiedTime;
+    record.modified_date = true_entry->modifiedDate;
+    record.entry_cluster = entry_cluster;
+    record.entry_index = entry_index;
+    record.lfn_cluster = lfn_cluster;
+    record.lfn_index = lfn_index;
+    record.entry_count = entry_count;
+    record.checksum_ok = 1;
+    return record;
+}
+
+unsigned char lfn_checksum(unsigned char *fname)
+{
+   int i;
+   unsigned char sum = 0;
+
+   for (i = 11; i; i--)
+      sum = ((sum & 1) << 7) + (sum >> 1) + *fname++;
+
+   return sum;
+}
+
+int short_name_number(const FatFile83 *entry){ // N of a ~N short name, 0 for the other names
+    if(entry->filename[0] != '~'){
+        return 0;
+    }
+    int number = 0;
+    for(int i = 1; i < sizeof(entry->filename) && entry->filename[i] >= '0' && entry->filename[i] <= '9'; i++){
+        number = number * 10 + (entry->filename[i] - '0');
+    }
+    return number;
+}
+
+struct Free_Run{ // Erased entries that follow each other in a directory chain, they can span clusters
+    int cluster;
+    int index;
+    int length;
+};
+
+struct Entry_Decoder{
+    // Decodes the LFN runs and their 8.3 entries of a directory one cluster at a time.
+    // Erased entries and . , .. entries are skipped. A run can continue in the next cluster.
+    // Runs of erased entries are kept in free_runs so that new entries can be written there.
+    vector<FatFileLFN> lfn_vec; // copies, so that the run can continue after its cluster is released
+    vector<Free_Run> free_runs;
+    int free_run_open = 0; // the last entry was erased
+    int last_short_number = 0; // Highest N of the ~N short names decoded
+    int lfn_cluster = -1;
+    int lfn_index = -1;
+    int next_true_entry = 0;
+    int end_cluster = -1; // First empty entry, set when it is reached
+    int end_index = -1;
+
+    int decode(const char *cluster_pointer, int entry_count, int cluster, vector<Dir_Record> &records){
+        // Returns 0 when the first empty entry is reached, 1 if the directory continues
+        for(int i = 0; i < entry_count; i++){
+            FatFileLFN* traverse_pointer = (FatFileLFN *) cluster_pointer;
+            traverse_pointer += i;
+
+            if(next_true_entry || traverse_pointer->sequence_number != 0xE5){
+                free_run_open = 0;
+            }
+            if(next_true_entry){
+                // Entry after the last LFN is the true FatFile83 directory entry
+                FatFile83 *true_entry = (FatFile83 *) traverse_pointer;
+                last_short_number = max(last_short_number, short_name_number(true_entry));
+                records.push_back(make_record(decode_lfn_name(lfn_vec), true_entry, cluster, i,
+                                              lfn_cluster, lfn_index, lfn_vec.size() + 1));
+                unsigned char checksum = lfn_checksum(true_entry->filename);
+                for(int k = 0; k < lfn_vec.size(); k++){
+                    if(lfn_vec[k].checksum != checksum){
+                        records.back().checksum_ok = 0;
+                    }
+                }
+                lfn_vec.clear();
+                next_true_entry = 0;
+                continue;
+            }
+            if(traverse_pointer->sequence_number == 0x00){
+                end_cluster = cluster;
+                end_index = i;
+                return 0;
+            }
+            else if(traverse_pointer->sequence_number == 0xE5){
+                if(free_run_open){
+                    free_runs.back().length++;
+                }
+                else{
+                    free_runs.push_back({cluster, i, 1});
+                    free_run_open = 1;
+                }
+                continue;
+            }
+            else if(traverse_pointer->sequence_number == 0x2E){
+                continue;
+            }
+            if(lfn_vec.empty()){
+                lfn_cluster = cluster;
+                lfn_index = i;
+            }
+            lfn_vec.push_back(*traverse_pointer);
+            next_true_entry = (static_cast<int>(traverse_pointer->sequence_number) == 1) || (static_cast<int>(traverse_pointer->sequence_number) == 65);
+        }
+        return 1;
+    }
+};
+
+class Directory_Locks{
+    /*
+        Reader-writer lock for each directory chain, keyed by the first cluster of the directory.
+        Commands that read a chain hold it shared, commands that add entries hold it exclusive while
+        the entries and the directory index are updated. A thread holds at most one exclusive lock
+        at a time, while holding it only the ancestors of the directory are locked shared on the way,
+        so the locks can not wait for each other in a cycle.
+    */
+    mutex map_lock;
+    unordered_map<int, unique_ptr<shared_mutex>> locks;
+
+    public:
+        shared_mutex &get(int directory_cluster){
+            lock_guard<mutex> lock(map_lock);
+            unique_ptr<shared_mutex> &found = locks[directory_cluster];
+            if(!found){
+                found.reset(new shared_mutex());
+            }
+            return *found;
+        }
+};
+
+Directory_Locks directory_locks;
+thread_local unordered_set<int> held_directories; // Directories locked by this thread, they are not locked again
+shared_mutex tree_lock; // Shared by every command, exclusive for the ones that walk or rewrite the whole tree
+atomic<uint64_t> tree_generation(0); // Changed under the exclusive tree_lock when directories are moved or freed
+thread_local uint64_t directory_generation = 0; // tree_generation when the session of this thread resolved its directory
+
+#define DIRECTORY_MOVES_KEPT 1024 // Directory moves kept for the sessions that did not resolve their directory since
+
+struct Directory_Move{ // A directory that mv moved from one path to another
+    uint64_t generation; // tree_generation after the move
+    string from;
+    string to;
+};
+
+deque<Directory_Move> directory_moves; // Changed under the exclusive tree_lock, oldest first
+
+string moved_directory_path(string path, const Directory_Move &move){ // path after the directory of move is moved
+    if(path == move.from){
+        return move.to;
+    }
+    if(path.compare(0, move.from.size() + 1, move.from + "/") == 0){
+        return move.to + path.substr(move.from.size());
+    }
+    return path;
+}
+
+class Directory_Guard{ // Holds the lock of a directory until it is released or destroyed
+    shared_mutex *lock = NULL;
+    int directory_cluster;
+    int exclusive;
+
+    public:
+        Directory_Guard(int directory_cluster_, int exclusive_) : directory_cluster(directory_cluster_), exclusive(exclusive_){
+            if(held_directories.count(directory_cluster)){ // the caller holds it already
+                return;
+            }
+            lock = &directory_locks.get(directory_cluster);
+            if(exclusive){
+                lock->lock();
+            }
+            else{
+                lock->lock_shared();
+            }
+            held_directories.insert(directory_cluster);
+        }
+        Directory_Guard(const Directory_Guard &) = delete;
+        Directory_Guard& operator=(const Directory_Guard &) = delete;
+        ~Directory_Guard(){
+            release();
+        }
+
+        void release(){
+            if(!lock){
+                return;
+            }
+            held_directories.erase(directory_cluster);
+            if(exclusive){
+                lock->unlock();
+            }
+            else{
+                lock->unlock_shared();
+            }
+            lock = NULL;
+        }
+};
+
+struct Directory_Scan{ // Entries of a directory chain and where new entries can be written
+    vector<Dir_Record> records;
+    int end_cluster = -1; // First empty entry, -1 if every entry of the chain is used
+    int end_index = -1;
+    int last_cluster = -1; // Last cluster of the chain
+    vector<Free_Run> free_runs; // Free slot map: runs of erased entries before the first empty entry, in chain order
+    int last_short_number = 0; // Highest N of the ~N short names in the directory, new entries get the next one
+
+    int take_free_run(int entry_required, Free_Run &run){
+        // First run that holds entry_required entries, it is removed from the map. Returns 0 if there is none.
+        for(int i = 0; i < free_runs.size(); i++){
+            if(free_runs[i].length >= entry_required){
+                run = free_runs[i];
+                free_runs.erase(free_runs.begin() + i);
+                return 1;
+            }
+        }
+        return 0;
+    }
+};
+
+void scan_directory(int directory_cluster, DATA_Block &dblock, FAT_Block &fblock, Directory_Scan &scan){
+    // Traverse the directory chain and decode every entry. Clusters after the first empty entry are not read.
+    int total_fat_entries = dblock.get_cluster_size() / sizeof(FatFile83);
+    Entry_Decoder decoder;
+    Chain_Prefetcher prefetcher(directory_cluster, dblock, fblock);
+    int traverse_cluster = directory_cluster;
+    for(; traverse_cluster >= ROOT_DIRECTORY && traverse_cluster < END_CLUSTER; traverse_cluster = fblock.get_from_fat(traverse_cluster)){
+        scan.last_cluster = traverse_cluster;
+        Cluster_Handle cluster_handle = dblock.get_from_dblock(traverse_cluster);
+        prefetcher.advance(1);
+        if(!decoder.decode((const char *) cluster_handle.data(), total_fat_entries, traverse_cluster, scan.records)){
+            break;
+        }
+    }
+    scan.end_cluster = decoder.end_cluster;
+    scan.end_index = decoder.end_index;
+    scan.free_runs.swap(decoder.free_runs);
+    scan.last_short_number = decoder.last_short_number;
+    for(; traverse_cluster >= ROOT_DIRECTORY && traverse_cluster < END_CLUSTER; traverse_cluster = fblock.get_from_fat(traverse_cluster)){
+        scan.last_cluster = traverse_cluster;
+    }
+}
+
+void scan_directory(int directory_cluster, DATA_Block &dblock, FAT_Block &fblock, vector<Dir_Record> &records){
+    Directory_Scan scan;
+    scan_directory(directory_cluster, dblock, fblock, scan);
+    records.swap(scan.records);
+}
+
+#define DEFAULT_INDEX_NAMES (1 << 20) // Maximum number of names kept in the directory index
+
+class Directory_Index{
+    /*
+        Name to entry map for each directory, keyed by the first cluster of the directory.
+        A directory is scanned once when it is first looked up, after that lookups are hash probes.
+        Create operations add their entries. When the total number of names exceeds max_names,
+        least recently used directories are dropped. The maps are guarded by index_lock.
+    */
+    struct Directory_Names{
+        unordered_map<string, Dir_Record> names;
+        list<uint32_t>::iterator lru_position;
+    };
+    unordered_map<uint32_t, Directory_Names> directories;
+    list<uint32_t> lru; // most recently used at the front
+    size_t name_count = 0;
+    size_t max_names = DEFAULT_INDEX_NAMES;
+    mutex index_lock;
+
+    void evict(uint32_t keep){
+        while(name_count > max_names && !lru.empty() && lru.back() != keep){
+            drop(lru.back());
+        }
+    }
+
+    Directory_Names &add_directory(uint32_t directory_cluster, vector<Dir_Record> &records){
+        // index_lock should be held by the caller. If the directory is indexed by another thread, that one is kept.
+        auto found = directories.find(directory_cluster);
+        if(found != directories.end()){
+            return found->second;
+        }
+        Directory_Names &directory = directories[directory_cluster];
+        for(int i = 0; i < records.size(); i++){
+            directory.names.emplace(records[i].name, records[i]); // if there are duplicates, first one is kept
+        }
+        name_count += directory.names.size();
+        lru.push_front(directory_cluster);
+        directory.lru_position = lru.begin();
+        evict(directory_cluster);
+        return directory;
+    }
+
+    int find_name(Directory_Names &directory, const string &name, Dir_Record &record){
+        auto found = directory.names.find(name);
+        if(found == directory.names.end()){
+            return 0;
+        }
+        record = found->second;
+        return 1;
+    }
+
+    public:
+        int lookup(uint32_t directory_cluster, const string &name, Dir_Record &record, DATA_Block &dblock, FAT_Block &fblock){
+            // Returns 1 and fills record if name exists in the directory, 0 otherwise
+            {
+                lock_guard<mutex> lock(index_lock);
+                auto found = directories.find(directory_cluster);
+                if(found != directories.end()){
+                    lru.splice(lru.begin(), lru, found->second.lru_position);
+                    io_stats.index_hits++;
+                    return find_name(found->second, name, record);
+                }
+            }
+            // Scanned without index_lock. The directory stays locked until its names are added,
+            // so an entry that is created meanwhile is not missed.
+            io_stats.index_misses++;
+            Directory_Guard directory_guard(directory_cluster, 0);
+            vector<Dir_Record> records;
+            scan_directory(directory_cluster, dblock, fblock, records);
+
+            lock_guard<mutex> lock(index_lock);
+            return find_name(add_directory(directory_cluster, records), name, record);
+        }
+
+        void fill(uint32_t directory_cluster, vector<Dir_Record> &records){
+            // Index a directory from the records of a scan done by the caller, who holds the directory locked
+            lock_guard<mutex> lock(index_lock);
+            add_directory(directory_cluster, records);
+        }
+
+        void insert(uint32_t directory_cluster, Dir_Record &record){
+            // If the directory is not indexed yet, it will be read with the new entry when it is needed
+            lock_guard<mutex> lock(index_lock);
+            auto found = directories.find(directory_cluster);
+            if(found == directories.end()){
+                return;
+            }
+            if(found->second.names.emplace(record.name, record).second){
+                name_count++;
+            }
+            evict(directory_cluster);
+        }
+
+        void remove(uint32_t directory_cluster, const string &name){
+            lock_guard<mutex> lock(index_lock);
+            auto found = directories.find(directory_cluster);
+            if(found != directories.end() && found->second.names.erase(name)){
+                name_count--;
+            }
+        }
+
+        void forget(uint32_t directory_cluster){ // the entries of the directory moved, it is read again when needed
+            lock_guard<mutex> lock(index_lock);
+            drop(directory_cluster);
+        }
+
+        void clear(){
+            lock_guard<mutex> lock(index_lock);
+            directories.clear();
+            lru.clear();
+            name_count = 0;
+        }
+
+        void drop(uint32_t directory_cluster){ // index_lock should be held by the caller
+            auto found = directories.find(directory_cluster);
+            if(found == directories.end()){
+                return;
+            }
+            name_count -= found->second.names.size();
+            lru.erase(found->second.lru_position);
+            directories.erase(found);
+        }
+};
+
+Directory_Index name_index;
+
+#define DEFAULT_PATH_CACHE_SIZE (1 << 16) // Maximum number of paths kept in the path cache
+
+struct Entry_Location{ // Where the 8.3 entry of a directory is stored, directory is -1 for the root
+    int directory = -1; // First cluster of the directory that holds the entry
+    int cluster = -1;
+    int index = -1;
+};
+
+class Path_Cache{
+    /*
+        Maps a normalized absolute path (/a/b/c) to the cluster it resolves to and the location of its entry.
+        cd_ starts from the longest cached prefix of the path, so a warm path is a single lookup.
+        Only the paths that exist are kept. When an entry is renamed or removed, the path and
+        everything below it is invalidated. If the cache is full, it is cleared.
+    */
+    struct Path_Entry{
+        int cluster;
+        Entry_Location location;
+    };
+    unordered_map<string, Path_Entry> clusters;
+    set<string> paths; // Same keys in order, used to find the paths below a prefix
+    size_t max_paths = DEFAULT_PATH_CACHE_SIZE;
+    mutex cache_lock;
+
+    public:
+        int longest_prefix(vector<string> &components, int &cluster, string &path, Entry_Location &location){
+            // Returns how many components are resolved from the cache. cluster, path and location are set to
+            // the result of that prefix. Root is always resolved.
+            vector<string> prefixes(components.size() + 1);
+            prefixes[0] = "/";
+            for(int i = 0; i < components.size(); i++){
+                prefixes[i + 1] = (i == 0 ? "" : prefixes[i]) + "/" + components[i];
+            }
+            lock_guard<mutex> lock(cache_lock);
+            for(int i = components.size(); i > 0; i--){
+                auto found = clusters.find(prefixes[i]);
+                if(found != clusters.end()){
+                    cluster = found->second.cluster;
+                    location = found->second.location;
+                    path = prefixes[i];
+                    io_stats.path_hits++;
+                    return i;
+                }
+            }
+            if(!components.empty()){
+                io_stats.path_misses++;
+            }
+            cluster = ROOT_DIRECTORY;
+            location = Entry_Location();
+            path = "/";
+            return 0;
+        }
+
+        void insert(const string &path, int cluster, Entry_Location &location){
+            lock_guard<mutex> lock(cache_lock);
+            if(clusters.size() >= max_paths){
+                clusters.clear();
+                paths.clear();
+            }
+            Path_Entry entry;
+            entry.cluster = cluster;
+            entry.location = location;
+            if(clusters.emplace(path, entry).second){
+                paths.insert(path);
+            }
+        }
+
+        void invalidate(const string &path){
+            // Remove path and the paths below it
+            lock_guard<mutex> lock(cache_lock);
+            clusters.erase(path);
+            paths.erase(path);
+            string below = path == "/" ? "/" : path + "/";
+            auto it = paths.lower_bound(below);
+            while(it != paths.end() && it->compare(0, below.size(), below) == 0){
+                clusters.erase(*it);
+                it = paths.erase(it);
+            }
+        }
+};
+
+Path_Cache path_cache;
+
+// Methods for CD.
+void seperate_path_file(string &path, string &file, string arg1){
+    int last_backward_slash = -1;
+    int first_backward_slash = -1;
+    for(int i = 0; i < arg1.size(); i++){
+        if(arg1[i] == '/'){
+            last_backward_slash = i;
+            if(first_backward_slash == -1){
+                first_backward_slash = i;
+            }
+        }
+    }
+
+    // if path /b   , b is file and / is path
+    // if path /b/c, c is file and /b is path
+    // if path b/c,  c is file and b is path and c is file  
+    // if path b  , b is file and path is ./
+
+
+    for(int i = 0; i < last_backward_slash; i++){
+        path += arg1[i];
+    }
+    for(int i = last_backward_slash+1; i < arg1.size(); i++){
+        file += arg1[i];
+    }
+
+    // Case 4
+    if(path == ""){
+        path = ".";
+    }
+    // Case 1
+    if(last_backward_slash == 0){
+        path = "/";
+    }
+
+    
+}
+void set_paths(vector<string> &paths, const char *curr_path){
+    // curr_path is the full path name
+    // either /a/b/c or b/c. 
+    int END_REACHED = 0;
+    int is_absolute = (curr_path[0] == '/');
+
+    string path = "";
+    int i = 0;
+    if(is_absolute){
+        i++;
+    }
+    while(!END_REACHED){
+        if(curr_path[i] == '\0'){
+            END_REACHED = 1;
+        }
+        else if(curr_path[i] == '/'){
+            //cout << "Path added : " << path << endl;
+            paths.push_back(path);
+            path = "";
+        }
+        else{
+            path += curr_path[i];
+        }
+        i++;
+    }
+    //cout << "Path added : " << path << endl;
+    paths.push_back(path);
+}
+
+void normalize_path(vector<string> &components, const char *curr_path, string &starting_directory){
+    // Convert the path into the components of an absolute path without . and ..
+    // If path is relative, it starts from starting_directory.
+    // .. at the root ends the path, rest of it is ignored.
+    vector<string> paths;
+    if(curr_path[0] != '/'){
+        set_paths(paths, starting_directory.c_str());
+    }
+    int start = paths.size();
+    set_paths(paths, curr_path);
+
+    for(int i = 0; i < paths.size(); i++){
+        string &next_path = paths[i];
+        if(next_path == "." || next_path == ""){ // Do nothing, "" comes from / at the start or //
+            continue;
+        }
+        else if(next_path == ".."){
+            if(components.empty()){ // Root has no parent
+                if(i >= start){
+                    break;
+                }
+                continue;
+            }
+            components.pop_back();
+        }
+        else{
+            components.push_back(next_path);
+        }
+    }
+}
+
+string child_path(string &directory, string &name){ // Path of name in the directory
+    if(directory == "/"){
+        return "/" + name;
+    }
+    return directory + "/" + name;
+}
 
-int cd_modify(string &destination,string &starting_directory, int &starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+int cd_(string &destination,string &starting_directory, int &starting_cluster, DATA_Block &dblock, FAT_Block &fblock, Entry_Location *entry_location = NULL){
     // Implementation of CD command. CD takes exactly one argument.
     /*
     1: procedure CD(path)
@@ -441,1317 +2117,2610 @@ int cd_modify(string &destination,string &starting_directory, int &starting_clus
         9: end if
     10: end procedure
     */
-
-    string current_path = starting_directory;
     vector<string> paths;
+    normalize_path(paths, destination.c_str(), starting_directory); // example : /paths/testdir/../dir -> {"paths","dir"}
+
+    // Start from the longest prefix that is resolved before, then find the
+    // remaining directories in the directory index. If entry_location is given, it is set to
+    // where the entry of the destination is.
+    int current_cluster;
+    string current_path;
+    Entry_Location location;
+    int path_count = path_cache.longest_prefix(paths, current_cluster, current_path, location);
+
+    for(; path_count < paths.size(); path_count++){
+        Dir_Record record;
+        if(!name_index.lookup(current_cluster, paths[path_count], record, dblock, fblock)){
+            return -1;
+        }
+        location.directory = current_cluster;
+        location.cluster = record.entry_cluster;
+        location.index = record.entry_index;
+        current_cluster = record.first_cluster;
+
+        if(current_path != "/"){
+            current_path += "/";
+        }
+        current_path += record.name;
+        path_cache.insert(current_path, current_cluster, location);
+    }
+    starting_cluster = current_cluster;
+    starting_directory = current_path;
+    if(entry_location){
+        *entry_location = location;
+    }
+    return 0;
+
+}
+
+
+void set_modified_time(Entry_Location &location, int directory_cluster, string &directory_path, DATA_Block &dblock, FAT_Block &fblock){
+    // Update the modification time of a directory through the location of its entry that is found when its
+    // path is resolved. If the entry is not there anymore, it is looked up again. Root has no entry.
+    if(location.directory == -1){
+        return;
+    }
+    Directory_Guard guard(location.directory, 1); // the entry is written
+    Cluster_Handle cluster_handle = dblock.get_from_dblock(location.cluster);
+    FatFile83 *true_entry = (FatFile83 *) cluster_handle.data() + location.index;
+    if(true_entry->filename[0] == 0xE5 || (uint32_t) ((true_entry->eaIndex << 16) | true_entry->firstCluster) != (uint32_t) directory_cluster){
+        string parent_path;
+        string directory_name;
+        seperate_path_file(parent_path, directory_name, directory_path);
+        Dir_Record record;
+        if(!name_index.lookup(location.directory, directory_name, record, dblock, fblock)){
+            return;
+        }
+        cluster_handle = dblock.get_from_dblock(record.entry_cluster);
+        true_entry = (FatFile83 *) cluster_handle.data() + record.entry_index;
+        location.cluster = record.entry_cluster;
+    }
+
+    time_t current_time = std::time(0);
+    struct tm local_time;
+    struct tm * time_struct = localtime_r(&current_time, &local_time); // sessions of the server create entries at the same time
+    true_entry->modifiedTime = (time_struct->tm_hour << 11) | (time_struct->tm_min << 5) | (time_struct->tm_sec / 2);
+    true_entry->modifiedDate = ((time_struct->tm_year - 80) << 9) | ((time_struct->tm_mon) << 5) | time_struct->tm_mday;
+    dblock.write_to_dblock(location.cluster, cluster_handle.data());
+}
+
+void produce_detailed_output(string header,int file_size,int min,int hour,int day,string month,string concat_file_name){
+    string min_start = "";
+    string day_start = "";
+    string hour_start = "";
+    string space = " ";
+    
+    if(day < 10){
+        day_start = "0";
+    }
+    if(hour < 10){
+        hour_start = "0";
+    }
+    if(min < 10){
+        min_start = "0";
+    }
+
+
+    output_stream() << header << file_size << space << month << space << day_start << day << space  <<  \
+            hour_start << hour << ":" << min_start << min << \
+            space << concat_file_name << "\n";
+}
+
+void set_date(int &min, int &hour, int &day, int date, int time, string &month ){
+    day = date & 0b0000000000011111;
+    hour = ((time & 0b1111100000000000) >> 11);
+    min = ((time & 0b0000011111100000) >> 5);
+
+    // Convert month
+    int monthid = (date & 0b0000000111100000) >> 5;
+    monthid += 1;
+    if(monthid == 1){
+        month = "January";
+    }
+    else if(monthid == 2){
+        month = "February"; 
+    }
+    else if(monthid == 3){
+        month = "March";
+
+    }    
+    else if(monthid == 4){
+        month = "April";
+    }
+    else if(monthid == 5){
+        month = "May";
+    }
+    else if(monthid == 6){
+        month = "June";
+    }
+    else if(monthid == 7){
+        month = "July";
+    } 
+    else if(monthid == 8){
+        month = "August";
+    }
+    else if(monthid == 9){
+        month = "September";
+    }
+    else if(monthid == 10){
+        month = "October";
+    }
+    else if(monthid == 11){
+        month = "November";
+    } 
+    else{
+        month = "December";
+    }
+}
+
+void cd(parsed_input *pinput,string &starting_directory, int &starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // cd is wrapped
+    string destination = pinput->arg1;
+    cd_(destination,starting_directory,starting_cluster,dblock,fblock);
+}
+
+void ls(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // We dont have to change starting_directory and starting_cluster. Using a "copy" instead of referance
+    // we can set this up.
 
+    // arg1 can take -l for extended information, arg2
+    // if -l provided, it will be always before the path! So if arg2 exist, arg1 is -l
+    // if arg1 exist, it is either -l for the current directory or the path
+    string arg1 = "";
+    string arg2 = "";
+    string fileHeader = "-rwx------ 1 root root ";
+    string directoryHeader = "drwx------ 1 root root ";
+    string path;
+    
+    string current_directory = starting_directory;
     int current_cluster = starting_cluster;
-    int DESTINATION_NOT_REACHED = 1;
-    int path_count = 0;
+
+
     int total_fat_entries = dblock.get_cluster_size() / sizeof(FatFile83);
-    // Set current cluster and path with respect to the whether path is absolute or not
-    set_starting_cluster(current_cluster, destination.c_str());
-    set_starting_directory(current_path, destination.c_str());
-
-    //cout << "Currents : " << current_path << current_cluster  << endl;
-    // Parse path into set of directories for traversing
-    set_paths(paths, destination.c_str()); // example : paths/testdir/dir -> {"paths","testdir","dir"}
-                                            // /paths/test/dir -> paths test dir as well
-    //cout << "Patrh length : " << paths.size() << endl;
-    while(DESTINATION_NOT_REACHED && path_count < paths.size()){
-        string next_path = paths[path_count];
-
-        //cout << "Target is :" << next_path << endl;
-        if(next_path == "."){ // Do nothing
-            path_count++;
+    int l_flag;
+
+    if(pinput->arg1){
+        arg1 = string(pinput->arg1);
+    }
+    if(pinput->arg2){
+        arg2 = string(pinput->arg2);
+    }
+    //cout << "arg1 " << arg1 << " arg2" << arg2 << endl;
+
+    if(arg2 != ""){ // ls -l path
+        path = arg2;
+        l_flag = 1;
+    }
+    else{
+        if(arg1 == ""){ // ls     
+            path = ".";
+            l_flag = 0;
+        }
+        else{ // ls -l or ls path 
+            if(arg1 == "-l"){
+                path = ".";
+                l_flag = 1;
+            }
+            else{ // ls  path
+                path = arg1;
+                l_flag = 0;
+            }
+        }
+    }
+
+
+    // CD into directory if possible
+    int path_exist = cd_(path,current_directory,current_cluster,dblock,fblock);
+
+    if(path_exist == -1){
+        return;
+    }
+
+    Directory_Guard directory_guard(current_cluster, 0); // entries are not added while they are listed
+    Entry_Decoder decoder;
+    vector<Dir_Record> records;
+    Chain_Prefetcher prefetcher(current_cluster, dblock, fblock);
+
+    // Entries are listed one cluster at a time, a run that continues in the next cluster is listed there
+    for(int traverse_cluster = current_cluster; traverse_cluster < END_CLUSTER; traverse_cluster = fblock.get_from_fat(traverse_cluster)){
+        Cluster_Handle cluster_handle = dblock.get_from_dblock(traverse_cluster);
+        prefetcher.advance(1);
+        records.clear();
+        int directory_continues = decoder.decode((const char *) cluster_handle.data(), total_fat_entries, traverse_cluster, records);
+        for(int i = 0; i < records.size(); i++){
+            if(l_flag){
+                // Set date with bits
+                string month;
+                int min;
+                int hour;
+                int day;
+                set_date(min,hour,day,records[i].modified_date,records[i].modified_time,month);
+
+                int is_directory = records[i].attributes == 0x10;
+                string header = is_directory ? directoryHeader : fileHeader;
+                int file_size = is_directory ? 0 : records[i].file_size;
+                produce_detailed_output(header,file_size,min,hour,day,month,records[i].name);
+            }
+            else{
+                output_stream() << records[i].name << " ";
+            }
+        }
+        if(!directory_continues){
+            if(!l_flag){
+                output_stream() << "\n";
+            }
+            return;
+        }
+    }
+
+}
+
+void string_to_c_str(string &string_, char* char_){
+    int i = 0;
+    for(; i < string_.size(); i++){
+
+        char_[i] = string_[i];
+    }
+    char_[i] = '\0';
+}
+
+
+// CAT
+
+void write_output(const char *data, size_t size){
+    // Write data to the output of the thread with large writes instead of going through the stream
+    if(output_sink.buffered){ // the stream writes large data directly once the buffered part is out
+        output_stream().write(data, size);
+        return;
+    }
+    output_stream().flush();
+    while(size > 0){
+        ssize_t w = write(output_sink.fd, data, size);
+        if(w < 0 && errno == EINTR){
             continue;
         }
-        else if(next_path == ".."){
-            // Must find the parent. If root, return error
-            if(current_path == "/"){
-                //std::cout << "Root has no parent" << std::endl;
-                DESTINATION_NOT_REACHED = 0;
-                path_count++;
+        if(w <= 0){
+            return;
+        }
+        data += w;
+        size -= w;
+    }
+}
+
+void get_cluster_runs(int first_cluster, uint64_t byte_count, unsigned int cluster_size, FAT_Block &fblock, vector<pair<int,int>> &runs){
+    // Follow the chain and merge consecutive clusters into (first cluster, cluster count) runs.
+    // Stops when the clusters for byte_count bytes are collected or the chain ends.
+    uint64_t clusters_left = (byte_count + cluster_size - 1) / cluster_size;
+    for(int current_cluster = first_cluster; current_cluster >= ROOT_DIRECTORY && current_cluster < END_CLUSTER && clusters_left > 0; current_cluster = fblock.get_from_fat(current_cluster)){
+        if(!runs.empty() && runs.back().first + runs.back().second == current_cluster){
+            runs.back().second++;
+        }
+        else{
+            runs.push_back(make_pair(current_cluster, 1));
+        }
+        clusters_left--;
+    }
+}
+
+int take_runs(vector<pair<int,int>> &runs, size_t &run, int &used, int capacity, vector<pair<int,int>> &pieces){
+    // Take up to capacity clusters from runs, starting used clusters into runs[run], and put them into pieces.
+    // run and used are moved past the taken clusters. Returns the number of clusters taken.
+    int taken = 0;
+    while(run < runs.size() && taken < capacity){
+        int count = runs[run].second - used < capacity - taken ? runs[run].second - used : capacity - taken;
+        pieces.push_back(make_pair(runs[run].first + used, count));
+        taken += count;
+        used += count;
+        if(used == runs[run].second){
+            run++;
+            used = 0;
+        }
+    }
+    return taken;
+}
+
+void read_file(int first_cluster, uint64_t file_size, FAT_Block &fblock, DATA_Block &dblock){
+    // Output exactly file_size bytes of the file. The runs of consecutive clusters are packed into the
+    // IO_BUFFER_SIZE buffer of the thread, read as one batch and written to the output as a whole.
+    unsigned int cluster_size = dblock.get_cluster_size();
+    vector<pair<int,int>> runs;
+    get_cluster_runs(first_cluster, file_size, cluster_size, fblock, runs);
+
+    int buffer_clusters = IO_BUFFER_SIZE / cluster_size;
+    char *buffer = io_ring().get_buffer();
+
+    uint64_t bytes_left = file_size;
+    Chain_Prefetcher prefetcher(first_cluster, dblock, fblock);
+    size_t run = 0;
+    int used = 0;
+    vector<pair<int,int>> pieces;
+    while(run < runs.size() && bytes_left > 0){
+        char *mapped = dblock.get_mapped(runs[run].first);
+        if(mapped){ // Write directly from the mapping
+            uint64_t size = (uint64_t) runs[run].second * cluster_size;
+            if(size > bytes_left){
+                size = bytes_left;
+            }
+            write_output(mapped, size);
+            bytes_left -= size;
+            prefetcher.advance(runs[run].second);
+            run++;
+            continue;
+        }
+        pieces.clear();
+        int count = take_runs(runs, run, used, buffer_clusters, pieces);
+        dblock.read_runs(pieces, buffer);
+        uint64_t size = (uint64_t) count * cluster_size;
+        if(size > bytes_left){
+            size = bytes_left;
+        }
+        write_output(buffer, size);
+        bytes_left -= size;
+        prefetcher.advance(count);
+    }
+}
+
+int locate_entry(string arg, string &current_directory, int &current_cluster, Dir_Record &record, DATA_Block &dblock, FAT_Block &fblock){
+    // Find the entry at path arg. current_directory and current_cluster are set to its parent.
+    // Returns -1 if the parent or the entry does not exist.
+    string path;
+    string file_name;
+    seperate_path_file(path,file_name,arg);
+
+    // CD into directory if possible
+    if(cd_(path,current_directory,current_cluster,dblock,fblock) == -1){
+        return -1;
+    }
+    if(!name_index.lookup(current_cluster, file_name, record, dblock, fblock)){
+        return -1;
+    }
+    return 0;
+}
+
+void cat(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // From the pinput, get the path + file name.
+    // CD into path
+    // Read the file if exist
+
+    string current_directory = starting_directory;
+    int current_cluster = starting_cluster;
+
+    // Find the file in the directory index. If exist, read it and output!
+    Dir_Record record;
+    if(locate_entry(string(pinput->arg1), current_directory, current_cluster, record, dblock, fblock) == -1){
+        return;
+    }
+    if(record.attributes == 0x10){
+        return; // if directory, nothing to output
+    }
+    // we have the entry. Read the content and switch cluster with FAT table!
+    read_file(record.first_cluster, record.file_size, fblock, dblock);
+
+}
+
+int copy_range(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t size){
+    // Copy size bytes between the files without passing the data through our buffers.
+    // copy_file_range is tried first, then sendfile, then pread + write. Returns -1 on error.
+    loff_t in_off = in_offset;
+    loff_t out_off = out_offset;
+    uint64_t left = size;
+    while(left > 0){
+        ssize_t copied = count_io(copy_file_range(in_fd, &in_off, out_fd, &out_off, left, 0), IO_READ | IO_WRITE);
+        if(copied < 0 && errno == EINTR){
+            continue;
+        }
+        if(copied <= 0){
+            break; // not supported for these files (EXDEV, EINVAL, ...), try the next method
+        }
+        left -= copied;
+    }
+
+    if(left > 0 && lseek(out_fd, out_off, SEEK_SET) == out_off){
+        off_t send_off = in_off;
+        while(left > 0){
+            ssize_t sent = count_io(sendfile(out_fd, in_fd, &send_off, left), IO_READ | IO_WRITE);
+            if(sent < 0 && errno == EINTR){
+                continue;
+            }
+            if(sent <= 0){
+                break;
+            }
+            left -= sent;
+            out_off += sent;
+        }
+        in_off = send_off;
+    }
+
+    if(left > 0){
+        thread_local vector<char> buffer; // sessions of the server copy at the same time
+        buffer.resize(IO_BUFFER_SIZE);
+        while(left > 0){
+            size_t chunk = left < IO_BUFFER_SIZE ? left : IO_BUFFER_SIZE;
+            ssize_t r = count_io(pread(in_fd, buffer.data(), chunk, in_off), IO_READ);
+            if(r < 0 && errno == EINTR){
                 continue;
             }
+            if(r <= 0){
+                return -1;
+            }
+            ssize_t done = 0;
+            while(done < r){
+                ssize_t w = count_io(pwrite(out_fd, buffer.data() + done, r - done, out_off + done), IO_WRITE);
+                if(w < 0 && errno == EINTR){
+                    continue;
+                }
+                if(w <= 0){
+                    return -1;
+                }
+                done += w;
+            }
+            in_off += r;
+            out_off += r;
+            left -= r;
+        }
+    }
+    return 0;
+}
+
+void cpout(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // Copy a file in the image to the host file system. Chain is converted to byte ranges
+    // in the image and each range is copied by the kernel.
+    if(!pinput->arg1 || !pinput->arg2){
+        return;
+    }
+    string current_directory = starting_directory;
+    int current_cluster = starting_cluster;
+
+    Dir_Record record;
+    if(locate_entry(string(pinput->arg1), current_directory, current_cluster, record, dblock, fblock) == -1){
+        return;
+    }
+    if(record.attributes == 0x10){
+        return; // directories are not copied
+    }
+
+    int host_fd = open(pinput->arg2, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(host_fd < 0){
+        return;
+    }
 
-            // Read the current block. 
-            void *cluster_pointer = dblock.get_from_dblock(current_cluster);
-            set_current_parent(cluster_pointer, current_cluster);
-            //cout << "Parent is set" << current_cluster << endl;
-            // Update current path
-            // a/b/c -> a/b so we have to remove /c
-            int BACKSLASH_DETECTED = 0;
-            while(!BACKSLASH_DETECTED){
-                //cout << current_path << endl;
-                char last = current_path.back();
-
-                if(last == '/'){    
-                    BACKSLASH_DETECTED = 1;
-                    if(current_cluster != 2){
-                        current_path.pop_back();
-                    }
-                }
-                else{
-                    current_path.pop_back();
-                    }
-            }
+    // Data is copied from the image file, so modified clusters should reach it first
+    dblock.flush();
 
-            //cout << current_path << endl;
-            path_count++;
-            continue;
+    unsigned int cluster_size = dblock.get_cluster_size();
+    vector<pair<int,int>> runs;
+    get_cluster_runs(record.first_cluster, record.file_size, cluster_size, fblock, runs);
 
+    uint64_t bytes_left = record.file_size;
+    uint64_t host_offset = 0;
+    for(int r = 0; r < runs.size() && bytes_left > 0; r++){
+        uint64_t size = (uint64_t) runs[r].second * cluster_size;
+        if(size > bytes_left){
+            size = bytes_left;
         }
-        else{  // Else, traverse the all cluster and check
-               // each entries and the target path.
-               // LFN comes first!
-            int break_loop = 0;
-            vector<FatFileLFN*> lfn_vec;
+        if(copy_range(dblock.get_fd(), dblock.get_cluster_offset(runs[r].first), host_fd, host_offset, size) == -1){
+            break;
+        }
+        host_offset += size;
+        bytes_left -= size;
+    }
+    close(host_fd);
+}
 
-            for(int traverse_cluster = current_cluster; traverse_cluster < END_CLUSTER; traverse_cluster = fblock.get_from_fat(traverse_cluster)){
-                void *cluster_pointer = dblock.get_from_dblock(traverse_cluster);
-                // LFN entries come first.
-                int i = 0;
-                for(; i < total_fat_entries; i++){    
-                    // If not the root, we have to start from 2, else start from 0
-                    FatFileLFN* traverse_pointer = (FatFileLFN *) cluster_pointer;
-                    traverse_pointer += i;
+int allocate_free_cluster(FAT_Block &fblock){
+    // Free clusters are tracked by FAT_Block, returns -1 if the volume is full
+    return fblock.allocate_cluster();
 
-                    if(traverse_pointer->sequence_number == 0x00){
-                        free(cluster_pointer);
-                        return -1;
-                    }
-                    else if(traverse_pointer->sequence_number == 0xE5){
-                        continue;
-                    }
+}
 
-                   else if(traverse_pointer->sequence_number == 0x2E){
-                        continue;
-                    }
-                    lfn_vec.push_back(traverse_pointer);
-                    int next_true_entry = (static_cast<int>(traverse_pointer->sequence_number) == 1) || (static_cast<int>(traverse_pointer->sequence_number) == 65);
-                    if(next_true_entry){
-                        //Now we are at true FatFile83 directory entry
-                        //Extract the name from the stack
-                        // Concatanate them to get the filneame
-                        // Compare it with the target
-                        // If true, calculate the next cluster index
-                        // Go to that cluster and continue looping!
-                        FatFile83 *true_entry = (FatFile83 *) cluster_pointer;
-                        true_entry += (i+1);
-                        string concat_file_name = "";
-                        next_true_entry = 0;
-                        int end_reached = 0;
-                        for(int i2 = 1; i2 < lfn_vec.size(); i2++){
-                            FatFileLFN* dummy = lfn_vec[i2];
-                            for(int j = 0; j < 5; j++){
-                                if(dummy->name1[j] == '\0'){
-                                    end_reached = 1;
-                                }   
-                                if(end_reached){
-                                    break;
-                                }
-                                concat_file_name += dummy->name1[j]; 
-
-                            }
-
-                            for(int j = 0; j < 6; j++){
-                                if(dummy->name2[j] == '\0'){
-                                    end_reached = 1;
-                                }   
-                                if(end_reached){
-                                    break;
-                                }    
-                                concat_file_name += dummy->name2[j];    
-                            }
-
-                            for(int j = 0; j < 2; j++){
-                                if(dummy->name3[j] == '\0'){
-                                    end_reached = 1;
-                                }   
-                                if(end_reached){
-                                    break;
-                                }   
-                                concat_file_name += dummy->name3[j];    
-                            }
-                        }
-                        FatFileLFN* dummy = lfn_vec[0];
-                        for(int j = 0; j < 5; j++){ 
-                            if(dummy->name1[j] == '\0'){
-                                end_reached = 1;
-                            }   
-                            if(end_reached){
-                                break;
-                            } 
-                            concat_file_name += dummy->name1[j];    
-                        }
 
-                        for(int j = 0; j < 6; j++){
-                            if(dummy->name2[j] == '\0'){
-                                end_reached = 1;
-                            }   
-                            if(end_reached){
-                                break;
-                            } 
-                            concat_file_name += dummy->name2[j];    
-                        }
+void create_lfn_list(vector<FatFileLFN> &lfn_list,string folder_name){
 
-                        for(int j = 0; j < 2; j++){
-                            if(dummy->name3[j] == '\0'){
-                                end_reached = 1;
-                            }   
-                            if(end_reached){
-                                break;
-                            } 
-                            concat_file_name += dummy->name3[j];    
-                        }
+    // Checksums are filled by set_lfn_checksum once the 8.3 entry is created
+    int lfn_size = lfn_list.size();
+    unsigned checksum = 0;
+    int i;
+    for(i = 0; i < lfn_size - 1; i++){
+        FatFileLFN* fat_file = new FatFileLFN();
 
-                        while(lfn_vec.size()){ // remove each element
-                            lfn_vec.pop_back();
-                        }
-                        if(concat_file_name == next_path){
-                            // F83 is the parent directory
-                            time_t current_time = std::time(0);
-                            struct tm * time_struct = std::localtime(&current_time);
-                            true_entry->modifiedTime = (time_struct->tm_hour << 11) | (time_struct->tm_min << 5) | (time_struct->tm_sec / 2);
-                            true_entry->modifiedDate = ((time_struct->tm_year - 80) << 9) | ((time_struct->tm_mon) << 5) | time_struct->tm_mday;
-                            FatFile83 *entry_ptr = (FatFile83 *) cluster_pointer;
-                            *(entry_ptr + i + 1)  = *true_entry;
-                            //cout << " Date is updated !";
-                            dblock.write_to_dblock(traverse_cluster,cluster_pointer);
-                            void *temp = dblock.get_from_dblock(traverse_cluster);
-                            entry_ptr = (FatFile83 *) temp;
-                            //cout << (entry_ptr + i + 1)->modifiedTime << endl;
-                            //cout << true_entry->modifiedTime << endl;
-                            break_loop = 1;
-                            break;
-                        }
+        fat_file->sequence_number = lfn_size - (i+1);
+        fat_file->attributes = 0x0F;
+        fat_file->reserved = 0x00;
+        fat_file->firstCluster = 0x0000;
+        fat_file->checksum =checksum;
 
-                    }
-                    if(break_loop){
-                        break;
-                    }
-                }
-                if(break_loop){
-                    break;
-                }
-            }
+        for(int j = 0; j < 5; j++){
+            //cout << "name1 -> " << j + 13*i << " written " << folder_name[j + 13*i] << endl;
+            fat_file->name1[j] = folder_name[j + 13*i];
+
+        }
+        for(int j = 0; j < 6; j++){
+            //cout << "name2 -> " << j + 5 + 13*i << " written " << folder_name[j + 5 + 13*i] << endl;
+            fat_file->name2[j] = folder_name[j + 5 + 13*i];
+                       
+        }
+        for(int j = 0; j < 2; j++){
+            //cout << "name3 -> " << j + 11 + 13*i << " written " << folder_name[j + 11 + 13*i] << endl;
+            fat_file->name3[j] = folder_name[j + 11 + 13*i];
         }
+        // calculate checkum here
+        lfn_list[i+1] = *(fat_file);
+
+    }
+    FatFileLFN* fat_file = new FatFileLFN();
+
+    fat_file->sequence_number = 0x41 + lfn_size - 1;
+    fat_file->attributes = 0x0F;
+    fat_file->reserved = 0x00;
+    fat_file->firstCluster = 0x0000;
 
-        path_count++;
-        if(path_count == paths.size()) {
-            DESTINATION_NOT_REACHED = 0;
+    int character_left = (folder_name.size() % 13) + 1; 
+    //cout << "Character left for lfn1 : " << character_left << endl;  
+    if(character_left <= 13){
+        for(int j = 0; j < 5; j++){
+            if(character_left <= 0){
+                break;
+            }
+            if(character_left-- == 1){
+                fat_file->name1[j] = '\0';
+            }
+            fat_file->name1[j] = folder_name[j + 13*i];
         }
     }
-    starting_cluster = current_cluster;
-    starting_directory = current_path;
-    return 0;
+    
+    if(character_left <= 8){
+        for(int j = 0; j < 6; j++){
+            if(character_left <= 0){
+                break;
+            }
+            if(character_left-- == 1){
+                fat_file->name2[j] = '\0';
+            }
+            fat_file->name2[j] = folder_name[j + 5 + 13*i];
+        }
+    }
+    if(character_left <= 2){
+        for(int j = 0; j < 2; j++){
+            if(character_left <= 0){
+                break;
+            }
+            if(character_left-- == 1){
+                fat_file->name3[j] = '\0';
+            }
+            fat_file->name3[j] = folder_name[j + 11 + 13*i];
+        }
+    }
+    
+    // calculate checkum here
+    fat_file->checksum = checksum;
+    lfn_list[0] = *(fat_file);
+    
+}
 
+
+void set_lfn_checksum(vector<FatFileLFN> &lfn_list, FatFile83 &f83_entry){ // Every LFN entry holds the checksum of the 8.3 name
+    unsigned char checksum = lfn_checksum(f83_entry.filename);
+    for(int i = 0; i < lfn_list.size(); i++){
+        lfn_list[i].checksum = checksum;
+    }
 }
 
-void produce_detailed_output(string header,int file_size,int min,int hour,int day,string month,string concat_file_name){
-    string min_start = "";
-    string day_start = "";
-    string hour_start = "";
-    string space = " ";
-    
-    if(day < 10){
-        day_start = "0";
+FatFile83 create_entry(int file_position, uint32_t new_cluster_index, int isFolder)
+{
+
+    FatFile83 directory_entry;
+    memset(&directory_entry, 0x20, sizeof(FatFile83));
+    string file_name;
+    if(file_position == -1){ // .
+        file_name = ".";
     }
-    if(hour < 10){
-        hour_start = "0";
+    else if(file_position == 0){
+        file_name = "..";
     }
-    if(min < 10){
-        min_start = "0";
+    else{    
+        file_name = "~" + to_string(file_position);
     }
 
+    directory_entry.firstCluster = new_cluster_index & 0xFFFF;
+    directory_entry.eaIndex = (new_cluster_index >> 16) & 0xFFFF;
+    directory_entry.fileSize = 0;
 
-    cout << header << file_size << space << month << space << day_start << day << space  <<  \
-            hour_start << hour << ":" << min_start << min << \
-            space << concat_file_name << endl;
-}
 
-void set_date(int &min, int &hour, int &day, int date, int time, string &month ){
-    day = date & 0b0000000000011111;
-    hour = ((time & 0b1111100000000000) >> 11);
-    min = ((time & 0b0000011111100000) >> 5);
+    // copy the names
+    for (int i = 0; i < file_name.size(); i++)
+    {
+        directory_entry.filename[i] = file_name[i];
+    }
 
-    // Convert month
-    int monthid = (date & 0b0000000111100000) >> 5;
-    monthid += 1;
-    if(monthid == 1){
-        month = "January";
+
+    if(isFolder){
+        directory_entry.attributes = 0x10;
     }
-    else if(monthid == 2){
-        month = "February"; 
+    else{
+        directory_entry.attributes = 0x20;
     }
-    else if(monthid == 3){
-        month = "March";
+    directory_entry.reserved = 0x0;
 
-    }    
-    else if(monthid == 4){
-        month = "April";
+    time_t current_time = std::time(0);
+    struct tm local_time;
+    struct tm * time_struct = localtime_r(&current_time, &local_time); // sessions of the server create entries at the same time
+    directory_entry.creationTime = (time_struct->tm_hour << 11) | (time_struct->tm_min << 5) | (time_struct->tm_sec / 2);
+    directory_entry.modifiedTime = directory_entry.creationTime;
+
+    directory_entry.creationDate = ((time_struct->tm_year - 80) << 9) | ((time_struct->tm_mon) << 5) | time_struct->tm_mday;
+    directory_entry.modifiedDate = directory_entry.creationDate;
+
+    return directory_entry;
+}
+
+
+void set_short_name(FatFile83 &entry, int file_position){ // 8.3 name of an entry is ~file_position
+    string file_name = "~" + to_string(file_position);
+    memset(entry.filename, 0x20, sizeof(entry.filename));
+    memset(entry.extension, 0x20, sizeof(entry.extension));
+    for(int i = 0; i < file_name.size() && i < sizeof(entry.filename); i++){
+        entry.filename[i] = file_name[i];
     }
-    else if(monthid == 5){
-        month = "May";
+}
+
+int write_entries(Directory_Scan &scan, string &name, FatFile83 &f83_entry, Dir_Record &record, DATA_Block &dblock, FAT_Block &fblock){
+    // Write the LFN run of name and f83_entry into the first run of erased entries that is large enough,
+    // otherwise at the first empty entry found by the scan. Clusters after that entry are cleared when the
+    // run reaches them, and the chain is extended if the run does not fit.
+    // Short name of f83_entry is set here. Returns -1 if there is no space.
+    int total_fat_entries = dblock.get_cluster_size() / sizeof(FatFile83);
+    int entry_required = name.size()/13 + 2; // if less than 13 : 1 LFN + 1 83
+    Free_Run free_run = {-1, -1, 0};
+    int reuse = scan.take_free_run(entry_required, free_run);
+
+    // Entries that are free in the chain, the clusters for the rest are allocated at once
+    int free_entries = 0;
+    if(reuse){
+        free_entries = entry_required;
     }
-    else if(monthid == 6){
-        month = "June";
+    else if(scan.end_cluster != -1){
+        free_entries = total_fat_entries - scan.end_index;
+        for(int cluster = fblock.get_from_fat(scan.end_cluster); cluster >= ROOT_DIRECTORY && cluster < END_CLUSTER && free_entries < entry_required; cluster = fblock.get_from_fat(cluster)){
+            free_entries += total_fat_entries;
+        }
     }
-    else if(monthid == 7){
-        month = "July";
-    } 
-    else if(monthid == 8){
-        month = "August";
+    vector<int> new_clusters;
+    if(free_entries < entry_required){
+        if(fblock.allocate_chain((entry_required - free_entries + total_fat_entries - 1) / total_fat_entries, new_clusters) == -1){
+            return -1;
+        }
+        fblock.write_to_fat(scan.last_cluster, new_clusters[0]);
     }
-    else if(monthid == 9){
-        month = "September";
+
+    // Fill the checksum, creation and modification date etc..
+    vector<FatFileLFN> lfn_list(entry_required-1);
+    set_short_name(f83_entry, ++scan.last_short_number); // not the entry count, entries can be removed
+    create_lfn_list(lfn_list,name);  // fill out entries in lfn_list and f83_entry
+    set_lfn_checksum(lfn_list,f83_entry);
+
+    int traverse_cluster = reuse ? free_run.cluster : scan.end_cluster;
+    int entry_index = reuse ? free_run.index : scan.end_index;
+    if(traverse_cluster == -1){ // every entry of the chain is used
+        traverse_cluster = new_clusters[0];
+        entry_index = 0;
     }
-    else if(monthid == 10){
-        month = "October";
+    Cluster_Handle cluster_handle = entry_index == 0 && !reuse ? dblock.get_empty_cluster(traverse_cluster) : dblock.get_from_dblock(traverse_cluster);
+    FatFileLFN *entries = (FatFileLFN *) cluster_handle.data();
+    int lfn_cluster = traverse_cluster; // Location of the first LFN and the 8.3 entry for the directory index
+    int lfn_index = entry_index;
+    int f83_cluster = -1; // set by the last entry of the run
+    int f83_index = -1;
+    for(int i = 0; i < entry_required; i++){
+        if(entry_index == total_fat_entries){ // continue in the next cluster, nothing in it is used unless the run is reused
+            dblock.write_to_dblock(traverse_cluster, entries);
+            traverse_cluster = fblock.get_from_fat(traverse_cluster);
+            entry_index = 0;
+            cluster_handle = reuse ? dblock.get_from_dblock(traverse_cluster) : dblock.get_empty_cluster(traverse_cluster);
+            entries = (FatFileLFN *) cluster_handle.data();
+        }
+        if(i == entry_required - 1){ // Thats the f83
+            entries[entry_index] = *((FatFileLFN *) &f83_entry);
+            f83_cluster = traverse_cluster;
+            f83_index = entry_index;
+        }
+        else{
+            entries[entry_index] = lfn_list[i];
+        }
+        entry_index++;
     }
-    else if(monthid == 11){
-        month = "November";
-    } 
-    else{
-        month = "December";
+    if(!reuse && entry_index < total_fat_entries){ // the entry after the run ends the directory
+        memset(&entries[entry_index], 0, sizeof(FatFileLFN));
     }
+    dblock.write_to_dblock(traverse_cluster, entries);
+    record = make_record(name, &f83_entry, f83_cluster, f83_index, lfn_cluster, lfn_index, entry_required);
+    return 0;
 }
 
-void cd(parsed_input *pinput,string &starting_directory, int &starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
-    // cd is wrapped
-    string destination = pinput->arg1;
-    cd_(destination,starting_directory,starting_cluster,dblock,fblock);
+int append_entry(int directory_cluster, string name, FatFile83 &f83_entry, Dir_Record &record, DATA_Block &dblock, FAT_Block &fblock){
+    // Write the entries of name after the last entry of the directory. The caller should hold the
+    // directory exclusive and make sure that the name is not used.
+    Directory_Scan scan;
+    scan_directory(directory_cluster, dblock, fblock, scan);
+    return write_entries(scan, name, f83_entry, record, dblock, fblock);
 }
 
-void ls(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
-    // We dont have to change starting_directory and starting_cluster. Using a "copy" instead of referance
-    // we can set this up.
-
-    // arg1 can take -l for extended information, arg2
-    // if -l provided, it will be always before the path! So if arg2 exist, arg1 is -l
-    // if arg1 exist, it is either -l for the current directory or the path
-    string arg1 = "";
-    string arg2 = "";
-    string fileHeader = "-rwx------ 1 root root ";
-    string directoryHeader = "drwx------ 1 root root ";
+int insert_entry(string arg1, string starting_directory, int starting_cluster, FatFile83 &f83_entry, const function<int(int)> &prepare, DATA_Block &dblock, FAT_Block &fblock){
+    // Create an entry at path arg1 from f83_entry. The parent is resolved once and its chain is scanned once,
+    // the scan tells if the name is used and where the new entries go. If prepare is given, it is called
+    // with the parent cluster once the name is known to be free, it can fill f83_entry or return -1 to stop.
+    // Modification time of the parent is updated through the location of its entry found on the way.
+    // Returns -1 if the parent does not exist, the name is used or there is no space.
     string path;
-    
+    string folder_name;
+    seperate_path_file(path,folder_name,arg1);
+    if(folder_name == "" || folder_name == "." || folder_name == ".."){
+        return -1;
+    }
     string current_directory = starting_directory;
     int current_cluster = starting_cluster;
-
-
-    int total_fat_entries = dblock.get_cluster_size() / sizeof(FatFile83);
-    int l_flag;
-
-    if(pinput->arg1){
-        arg1 = string(pinput->arg1);
-    }
-    if(pinput->arg2){
-        arg2 = string(pinput->arg2);
-    }
-    //cout << "arg1 " << arg1 << " arg2" << arg2 << endl;
-
-    if(arg2 != ""){ // ls -l path
-        path = arg2;
-        l_flag = 1;
+    Entry_Location parent_location;
+    if(cd_(path,current_directory,current_cluster,dblock,fblock,&parent_location) == -1){
+        return -1;
     }
-    else{
-        if(arg1 == ""){ // ls     
-            path = ".";
-            l_flag = 0;
-        }
-        else{ // ls -l or ls path 
-            if(arg1 == "-l"){
-                path = ".";
-                l_flag = 1;
-            }
-            else{ // ls  path
-                path = arg1;
-                l_flag = 0;
-            }
+
+    // The parent stays locked from the scan until the entry is in the index
+    Directory_Guard parent_guard(current_cluster, 1);
+    Directory_Scan scan;
+    scan_directory(current_cluster, dblock, fblock, scan);
+    for(int i = 0; i < scan.records.size(); i++){
+        if(scan.records[i].name == folder_name){
+            return -1;
         }
     }
+    if(prepare && prepare(current_cluster) == -1){
+        return -1;
+    }
+    Dir_Record record;
+    if(write_entries(scan, folder_name, f83_entry, record, dblock, fblock) == -1){
+        return -1;
+    }
+    name_index.fill(current_cluster, scan.records); // the scan indexes the parent if it is not indexed yet
+    name_index.insert(current_cluster, record);
+    path_cache.invalidate(child_path(current_directory, folder_name));
+    parent_guard.release(); // only one directory is held exclusive at a time
 
+    set_modified_time(parent_location, current_cluster, current_directory, dblock, fblock);
+    return 0;
+}
 
-    // CD into directory if possible
-    int path_exist = cd_(path,current_directory,current_cluster,dblock,fblock);
+void mkdir(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // The new directory gets a cluster that holds . and .. entries
+    if(!pinput->arg1){
+        return;
+    }
+    int dir_entry_cluster = -1;
+    FatFile83 f83_entry = create_entry(1, 0, 1); // short name is given when it is written
+    auto prepare = [&](int parent_cluster) -> int {
+        dir_entry_cluster = allocate_free_cluster(fblock);
+        if(dir_entry_cluster == -1){
+            return -1;
+        }
+        Cluster_Handle subdirectory_handle = dblock.get_empty_cluster(dir_entry_cluster);
+        FatFile83 *sub_ptr = (FatFile83 *) subdirectory_handle.data();
+        *sub_ptr = create_entry(-1, dir_entry_cluster,1); // point to current
+        *(sub_ptr + 1) = create_entry(0, parent_cluster,1); // point to parent
+        dblock.write_to_dblock(dir_entry_cluster, subdirectory_handle.data());
+        f83_entry.firstCluster = dir_entry_cluster & 0xFFFF;
+        f83_entry.eaIndex = (dir_entry_cluster >> 16) & 0xFFFF;
+        return 0;
+    };
+    if(insert_entry(string(pinput->arg1), starting_directory, starting_cluster, f83_entry, prepare, dblock, fblock) == -1 && dir_entry_cluster != -1){
+        fblock.write_to_fat(dir_entry_cluster, 0); // no space for the entries
+    }
+}
 
-    if(path_exist == -1){
+int add_entry(string arg1, string starting_directory, int starting_cluster, uint32_t first_cluster, uint32_t file_size, int is_folder, DATA_Block &dblock, FAT_Block &fblock){
+    // Create an entry at path arg1 that starts at first_cluster and holds file_size bytes.
+    // Returns -1 if the parent does not exist or the name is already used.
+    FatFile83 f83_entry = create_entry(1,first_cluster,is_folder); // short name is given when it is written
+    f83_entry.fileSize = file_size;
+    return insert_entry(arg1, starting_directory, starting_cluster, f83_entry, nullptr, dblock, fblock);
+}
+
+void touch(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // Empty file, no cluster is allocated
+    add_entry(string(pinput->arg1), starting_directory, starting_cluster, 0, 0, 0, dblock, fblock);
+}
+
+void cpin(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // Copy a host file into the image. Clusters are allocated at once (contiguous if possible),
+    // content is written run by run with large writes and then the entry is created.
+    if(!pinput->arg1 || !pinput->arg2){
+        return;
+    }
+    int host_fd = open(pinput->arg1, O_RDONLY);
+    if(host_fd < 0){
         return;
     }
+    struct stat host_stat;
+    if(fstat(host_fd, &host_stat) == -1 || !S_ISREG(host_stat.st_mode) || host_stat.st_size > 0xFFFFFFFFLL){
+        close(host_fd); // fileSize is 32 bits
+        return;
+    }
+    uint32_t file_size = host_stat.st_size;
 
-    int break_loop = 0;
-    vector<FatFileLFN*> lfn_vec;
+    // Check the target before allocating anything
+    string arg2 = string(pinput->arg2);
+    string current_directory = starting_directory;
+    int current_cluster = starting_cluster;
+    Dir_Record record;
+    string path;
+    string file_name;
+    seperate_path_file(path, file_name, arg2);
+    if(file_name == "" || cd_(path, current_directory, current_cluster, dblock, fblock) == -1 ||
+       name_index.lookup(current_cluster, file_name, record, dblock, fblock)){
+        close(host_fd);
+        return;
+    }
 
-    for(int traverse_cluster = current_cluster; traverse_cluster < END_CLUSTER; traverse_cluster = fblock.get_from_fat(traverse_cluster)){
-        void *cluster_pointer = dblock.get_from_dblock(traverse_cluster);
-        // LFN entries come first.
-        int i = 0;
-        for(; i < total_fat_entries; i++){    
-            // If not the root, we have to start from 2
-            FatFileLFN* traverse_pointer = (FatFileLFN *) cluster_pointer;
-            traverse_pointer += i;
-            if(traverse_pointer->sequence_number == 0x00){
-                free(cluster_pointer);
-                if(!l_flag){
-                    cout << endl;
-                }
-                return;
-            }
-            else if(traverse_pointer->sequence_number == 0xE5){
+    unsigned int cluster_size = dblock.get_cluster_size();
+    unsigned int cluster_count = (file_size + (uint64_t) cluster_size - 1) / cluster_size;
+    vector<int> clusters;
+    if(cluster_count > 0 && fblock.allocate_chain(cluster_count, clusters) == -1){
+        close(host_fd);
+        return; // not enough space
+    }
+
+    int buffer_clusters = IO_BUFFER_SIZE / cluster_size;
+    char *buffer = io_ring().get_buffer(); // buffer of the thread, so sessions of the server can copy at the same time
+
+    uint64_t host_offset = 0;
+    int i = 0;
+    while(i < clusters.size()){
+        // Take as many consecutive clusters as the buffer can hold
+        int count = 1;
+        while(i + count < clusters.size() && count < buffer_clusters && clusters[i + count] == clusters[i] + count){
+            count++;
+        }
+        size_t size = (size_t) count * cluster_size;
+        size_t filled = 0;
+        while(filled < size){
+            ssize_t r = count_io(pread(host_fd, buffer + filled, size - filled, host_offset + filled), IO_READ);
+            if(r < 0 && errno == EINTR){
                 continue;
             }
-            else if(traverse_pointer->sequence_number == 0x2E){
-                continue;
+            if(r <= 0){
+                break;
             }
+            filled += r;
+        }
+        memset(buffer + filled, 0, size - filled); // rest of the last cluster
+        dblock.write_clusters(clusters[i], count, buffer);
+        host_offset += size;
+        i += count;
+    }
+    close(host_fd);
 
-            lfn_vec.push_back(traverse_pointer);
-            //std::cout << "Hex : " << std::hex << static_cast<int>(traverse_pointer->sequence_number) << std::endl;
-            //cout << " NTE : " << (static_cast<int>(traverse_pointer->sequence_number) == 1) << endl;
-            //cout << " NTE 2 : " << (static_cast<int>(traverse_pointer->sequence_number) == 65) << endl;
-            
-            //int next_true_entry = ((traverse_pointer->sequence_number & 0x1) == 1);
-            
-            int next_true_entry = (static_cast<int>(traverse_pointer->sequence_number) == 1) || (static_cast<int>(traverse_pointer->sequence_number) == 65);
-            if(next_true_entry){
-                //Now we are at true FatFile83 directory entry
-                //Extract the name from the stack
-                // Concatanate them to get the filneame
-                // Compare it with the target
-                // If true, calculate the next cluster index
-                // Go to that cluster and continue looping
-                i += 1;
-                FatFile83 *true_entry = (FatFile83 *) cluster_pointer;
-                true_entry += i;
-                string concat_file_name = "";
-                next_true_entry = 0;
-                int end_reached = 0;
-                for(int i2 = 1; i2 < lfn_vec.size(); i2++){
-                    FatFileLFN* dummy = lfn_vec[i2];
-                    for(int j = 0; j < 5; j++){
-                        if(dummy->name1[j] == '\0'){
-                            end_reached = 1;
-                        }   
-                        if(end_reached){
-                            break;
-                        }
-                        concat_file_name += dummy->name1[j]; 
-
-                    }
-
-                    for(int j = 0; j < 6; j++){
-                        if(dummy->name2[j] == '\0'){
-                            end_reached = 1;
-                        }   
-                        if(end_reached){
-                            break;
-                        }    
-                        concat_file_name += dummy->name2[j];    
-                    }
+    uint32_t first_cluster = clusters.empty() ? 0 : clusters[0];
+    if(add_entry(arg2, starting_directory, starting_cluster, first_cluster, file_size, 0, dblock, fblock) == -1){
+        for(int j = 0; j < clusters.size(); j++){ // give the clusters back
+            fblock.write_to_fat(clusters[j], 0);
+        }
+    }
+}
 
-                    for(int j = 0; j < 2; j++){
-                        if(dummy->name3[j] == '\0'){
-                            end_reached = 1;
-                        }   
-                        if(end_reached){
-                            break;
-                        }   
-                        concat_file_name += dummy->name3[j];    
-                    }
-                }
-                FatFileLFN* dummy = lfn_vec[0];
-                for(int j = 0; j < 5; j++){ 
-                    if(dummy->name1[j] == '\0'){
-                        end_reached = 1;
-                    }   
-                    if(end_reached){
-                        break;
-                    } 
-                    concat_file_name += dummy->name1[j];    
-                }
+// MV
+void erase_entry(Dir_Record &record, DATA_Block &dblock, FAT_Block &fblock){
+    // Mark the LFN run and the 8.3 entry of record as erased (0xE5). The run may continue in the next cluster.
+    int total_fat_entries = dblock.get_cluster_size() / sizeof(FatFile83);
+    int traverse_cluster = record.lfn_cluster;
+    int entry_index = record.lfn_index;
+    int entry_left = record.entry_count;
+    while(entry_left > 0 && traverse_cluster >= ROOT_DIRECTORY && traverse_cluster < END_CLUSTER){
+        Cluster_Handle cluster_handle = dblock.get_from_dblock(traverse_cluster);
+        FatFileLFN *entries = (FatFileLFN *) cluster_handle.data();
+        for(; entry_index < total_fat_entries && entry_left > 0; entry_index++, entry_left--){
+            entries[entry_index].sequence_number = 0xE5;
+        }
+        dblock.write_to_dblock(traverse_cluster, cluster_handle.data());
+        traverse_cluster = fblock.get_from_fat(traverse_cluster);
+        entry_index = 0;
+    }
+}
 
-                for(int j = 0; j < 6; j++){
-                    if(dummy->name2[j] == '\0'){
-                        end_reached = 1;
-                    }   
-                    if(end_reached){
-                        break;
-                    } 
-                    concat_file_name += dummy->name2[j];    
-                }
+void set_parent_entry(int directory_cluster, int parent_cluster, DATA_Block &dblock){
+    // Point the .. entry of the directory to parent_cluster. . and .. are the first two entries.
+    Cluster_Handle cluster_handle = dblock.get_from_dblock(directory_cluster);
+    FatFile83 *parent_entry = (FatFile83 *) cluster_handle.data() + 1;
+    if(parent_entry->filename[0] != '.' || parent_entry->filename[1] != '.'){
+        return;
+    }
+    parent_entry->firstCluster = parent_cluster & 0xFFFF;
+    parent_entry->eaIndex = (parent_cluster >> 16) & 0xFFFF;
+    dblock.write_to_dblock(directory_cluster, cluster_handle.data());
+}
 
-                for(int j = 0; j < 2; j++){
-                    if(dummy->name3[j] == '\0'){
-                        end_reached = 1;
-                    }   
-                    if(end_reached){
-                        break;
-                    } 
-                    concat_file_name += dummy->name3[j];    
-                }
+int is_directory_path(string path, DATA_Block &dblock, FAT_Block &fblock){ // path should be absolute
+    if(path == "/"){
+        return 1;
+    }
+    string parent_directory = "/";
+    int parent_cluster = ROOT_DIRECTORY;
+    Dir_Record record;
+    return locate_entry(path, parent_directory, parent_cluster, record, dblock, fblock) != -1 && (record.attributes & 0x10);
+}
 
-                while(lfn_vec.size()){ // remove each element
-                    lfn_vec.pop_back();
-                }
+void mv(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // mv <source> <destination> : if destination is a directory, the entry is moved into it with its name,
+    // otherwise destination is the new path of the entry. Only the directory entries are moved (and ..
+    // of a moved directory), contents are not touched.
+    // mv runs alone (see run_command) since it changes two directories and the paths below the entry,
+    // so the directories are not locked.
+    if(!pinput->arg1 || !pinput->arg2){
+        return;
+    }
+    string source = string(pinput->arg1);
+    string destination = string(pinput->arg2);
+    string source_path;
+    string source_name;
+    seperate_path_file(source_path, source_name, source);
+    if(source_name == "" || source_name == "." || source_name == ".."){
+        return;
+    }
+    string source_directory = starting_directory;
+    int source_cluster = starting_cluster;
+    Dir_Record record;
+    if(locate_entry(source, source_directory, source_cluster, record, dblock, fblock) == -1){
+        return;
+    }
 
-                //cout << "Files : " << concat_file_name  << endl;
-                if(l_flag){
+    string target_directory = starting_directory;
+    int target_cluster = starting_cluster;
+    string target_name = record.name;
+    Dir_Record existing;
+    if(cd_(destination, target_directory, target_cluster, dblock, fblock) == -1 ||
+       !is_directory_path(target_directory, dblock, fblock)){
+        // Not a directory, destination is the new path
+        string target_path;
+        target_name = "";
+        seperate_path_file(target_path, target_name, destination);
+        target_directory = starting_directory;
+        target_cluster = starting_cluster;
+        if(target_name == "" || target_name == "." || target_name == ".." ||
+           cd_(target_path, target_directory, target_cluster, dblock, fblock) == -1){
+            return;
+        }
+    }
+    if(name_index.lookup(target_cluster, target_name, existing, dblock, fblock)){
+        return; // the name is used in the target directory, or the entry is moved onto itself
+    }
+    string moved_path = child_path(source_directory, record.name);
+    if(target_directory == moved_path || target_directory.compare(0, moved_path.size() + 1, moved_path + "/") == 0){
+        return; // a directory can not be moved below itself
+    }
 
-                    // Set date with bits
-                    string month;
-                    int min;
-                    int hour;
-                    int day;
+    // The new entry is written before the old one is erased
+    FatFile83 f83_entry;
+    {
+        Cluster_Handle cluster_handle = dblock.get_from_dblock(record.entry_cluster);
+        f83_entry = *((FatFile83 *) cluster_handle.data() + record.entry_index);
+    }
+    Dir_Record moved;
+    if(append_entry(target_cluster, target_name, f83_entry, moved, dblock, fblock) == -1){
+        return;
+    }
+    erase_entry(record, dblock, fblock);
+    if((record.attributes & 0x10) && target_cluster != source_cluster){
+        set_parent_entry(record.first_cluster, target_cluster, dblock);
+    }
 
-                    int date = true_entry->modifiedDate;
-                    int time = true_entry->modifiedTime;
+    name_index.remove(source_cluster, record.name);
+    name_index.insert(target_cluster, moved);
+    path_cache.invalidate(moved_path);
+    path_cache.invalidate(child_path(target_directory, target_name));
+    if(record.attributes & 0x10){ // sessions in the directory follow it to the new path
+        directory_moves.push_back({++tree_generation, moved_path, child_path(target_directory, target_name)});
+        if(directory_moves.size() > DIRECTORY_MOVES_KEPT){
+            directory_moves.pop_front();
+        }
+    }
+}
 
-                    set_date(min,hour,day,date,time,month);
+// COMPACT
+void compact(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // compact [directory] : move the entries of the directory to the front of its chain so that no erased
+    // entries are left between them, then free the clusters after the last one that is still used.
+    // Entries move, so compact runs alone (see run_command) and the directory is dropped from the caches.
+    string directory = pinput->arg1 ? string(pinput->arg1) : string(".");
+    string current_directory = starting_directory;
+    int current_cluster = starting_cluster;
+    if(cd_(directory, current_directory, current_cluster, dblock, fblock) == -1 ||
+       !is_directory_path(current_directory, dblock, fblock)){
+        return;
+    }
 
-                    int is_directory = true_entry->attributes == 0x10;
-                    string header;
-                    int file_size;
-                    if(is_directory){
-                        header = directoryHeader;
-                        file_size = 0;
-                    }
-                    else{
-                        header = fileHeader;
-                        file_size = true_entry -> fileSize;
-                    }
-                    produce_detailed_output(header,file_size,min,hour,day,month, concat_file_name);
-                }
-                else{
-                    cout << concat_file_name << " ";
-                }
-            }
-            if(break_loop){
+    int total_fat_entries = dblock.get_cluster_size() / sizeof(FatFile83);
+    vector<int> chain;
+    vector<FatFileLFN> entries; // entries that are kept, in order
+    int erased = 0;
+    int end_reached = 0;
+    Chain_Prefetcher prefetcher(current_cluster, dblock, fblock);
+    for(int traverse_cluster = current_cluster; traverse_cluster >= ROOT_DIRECTORY && traverse_cluster < END_CLUSTER; traverse_cluster = fblock.get_from_fat(traverse_cluster)){
+        chain.push_back(traverse_cluster);
+        if(end_reached){ // clusters after the first empty entry are not read
+            continue;
+        }
+        Cluster_Handle cluster_handle = dblock.get_from_dblock(traverse_cluster);
+        prefetcher.advance(1);
+        FatFileLFN *cluster_entries = (FatFileLFN *) cluster_handle.data();
+        for(int i = 0; i < total_fat_entries; i++){
+            if(cluster_entries[i].sequence_number == 0x00){
+                end_reached = 1;
                 break;
             }
+            if(cluster_entries[i].sequence_number == 0xE5){
+                erased++;
+                continue;
+            }
+            entries.push_back(cluster_entries[i]);
         }
-        if(break_loop){
-            break;
+    }
+    int used_clusters = max<int>(1, (entries.size() + total_fat_entries - 1) / total_fat_entries);
+    if(chain.empty() || (erased == 0 && used_clusters == chain.size())){
+        return;
+    }
+
+    // Kept entries are written from the start of the chain, the rest of the last used cluster is cleared
+    for(int i = 0; i < used_clusters; i++){
+        Cluster_Handle cluster_handle = dblock.get_empty_cluster(chain[i]);
+        size_t first = (size_t) i * total_fat_entries;
+        size_t count = min<size_t>(total_fat_entries, entries.size() - min(entries.size(), first));
+        if(count){
+            memcpy(cluster_handle.data(), &entries[first], count * sizeof(FatFileLFN));
+        }
+        dblock.write_to_dblock(chain[i], cluster_handle.data());
+    }
+    if(used_clusters < chain.size()){
+        fblock.write_to_fat(chain[used_clusters - 1], END_CLUSTER);
+        for(int i = used_clusters; i < chain.size(); i++){
+            fblock.write_to_fat(chain[i], 0);
         }
     }
 
+    name_index.forget(current_cluster);
+    path_cache.invalidate(current_directory);
 }
 
-void string_to_c_str(string &string_, char* char_){
-    int i = 0;
-    for(; i < string_.size(); i++){
-
-        char_[i] = string_[i];
+// RM
+void collect_subtree(int directory_cluster, vector<int> &chains, DATA_Block &dblock, FAT_Block &fblock){
+    // Add the chains of every entry below the directory to chains, the directory itself is not added.
+    // The directories are dropped from the name index since their clusters will be freed.
+    vector<int> directories(1, directory_cluster);
+    unordered_set<int> visited(directories.begin(), directories.end()); // a broken image can link a directory twice
+    while(!directories.empty()){
+        int cluster = directories.back();
+        directories.pop_back();
+        vector<Dir_Record> records;
+        scan_directory(cluster, dblock, fblock, records);
+        name_index.forget(cluster);
+        for(int i = 0; i < records.size(); i++){
+            int first_cluster = records[i].first_cluster;
+            if(first_cluster <= ROOT_DIRECTORY || visited.count(first_cluster)){ // empty files have no chain, root is never freed
+                continue;
+            }
+            if(records[i].attributes & 0x10){
+                visited.insert(first_cluster);
+                directories.push_back(first_cluster);
+            }
+            chains.push_back(first_cluster);
+        }
     }
-    char_[i] = '\0';
 }
 
-
-// CAT
-
-void read_cluster(int current_cluster, FAT_Block &fblock, DATA_Block &dblock){
-    int END_REACHED = 0;
-    int cluster_size = dblock.get_cluster_size();
-    while(current_cluster < 0x0FFFFFF8){
-        void* cluster_pointer = dblock.get_from_dblock(current_cluster); // get the cluster
-        char* character_pointer = (char *) cluster_pointer;
-
-
-        //read all cluster with character pointer
-        for(int i = 0; i < cluster_size; i++){
-            char current = *(character_pointer + i);
-            if(current == -1){ // EOF
-                cout << endl;
-                END_REACHED = 1;
-                return;
+int remove_entry(string arg, int recursive, int directory_only, string starting_directory, int starting_cluster, vector<int> &chains, DATA_Block &dblock, FAT_Block &fblock){
+    // Erase the entry at path arg and add the chains to free to chains. A directory is removed only if it is
+    // empty, unless recursive is set. If directory_only is set, files are not removed.
+    // Returns -1 if the entry does not exist or can not be removed.
+    string path;
+    string file_name;
+    seperate_path_file(path, file_name, arg);
+    if(file_name == "" || file_name == "." || file_name == ".."){
+        return -1;
+    }
+    string parent_directory = starting_directory;
+    int parent_cluster = starting_cluster;
+    Dir_Record record;
+    if(locate_entry(arg, parent_directory, parent_cluster, record, dblock, fblock) == -1){
+        return -1;
+    }
+    int is_folder = (record.attributes & 0x10) != 0;
+    if(directory_only && !is_folder){
+        return -1;
+    }
+    if(is_folder && record.first_cluster >= ROOT_DIRECTORY){
+        if(record.first_cluster == ROOT_DIRECTORY){ // a broken entry that points to the root
+            return -1;
+        }
+        if(recursive){
+            collect_subtree(record.first_cluster, chains, dblock, fblock);
+        }
+        else{
+            if(!directory_only){ // rm without -r does not remove directories
+                return -1;
             }
-            
-            cout << current ;
-
+            vector<Dir_Record> records;
+            scan_directory(record.first_cluster, dblock, fblock, records);
+            if(!records.empty()){
+                return -1;
+            }
+            name_index.forget(record.first_cluster);
         }
+    }
 
-        current_cluster = fblock.get_from_fat(current_cluster);
-
+    erase_entry(record, dblock, fblock);
+    name_index.remove(parent_cluster, record.name);
+    path_cache.invalidate(child_path(parent_directory, record.name));
+    if(record.first_cluster >= ROOT_DIRECTORY){
+        chains.push_back(record.first_cluster);
+        if(is_folder){
+            tree_generation++; // sessions in the removed directories go back to the root
+        }
     }
+    return 0;
 }
 
-void seperate_path_file(string &path, string &file, string arg1){
-    int last_backward_slash = -1;
-    int first_backward_slash = -1;
-    for(int i = 0; i < arg1.size(); i++){
-        if(arg1[i] == '/'){
-            last_backward_slash = i;
-            if(first_backward_slash == -1){
-                first_backward_slash = i;
-            }
+void rm(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // rm [-r] <path> [path] : remove files, with -r also directories with everything below them.
+    // Entries are erased first, then the chains of all of them are freed at once, so each FAT sector is
+    // updated in memory in one pass and written once. rm runs alone (see run_command) since it frees
+    // clusters that other commands could be reading, and other sessions could have as their directory.
+    char *args[3] = {pinput->arg1, pinput->arg2, pinput->arg3};
+    int recursive = 0;
+    vector<int> chains;
+    for(int i = 0; i < 3; i++){
+        if(!args[i]){
+            continue;
+        }
+        if(i == 0 && !strcmp(args[i], "-r")){
+            recursive = 1;
+            continue;
         }
+        remove_entry(string(args[i]), recursive, 0, starting_directory, starting_cluster, chains, dblock, fblock);
     }
+    fblock.free_chains(chains);
+}
 
-    // if path /b   , b is file and / is path
-    // if path /b/c, c is file and /b is path
-    // if path b/c,  c is file and b is path and c is file  
-    // if path b  , b is file and path is ./
+void rmdir(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // rmdir <path> [path] : remove empty directories
+    char *args[3] = {pinput->arg1, pinput->arg2, pinput->arg3};
+    vector<int> chains;
+    for(int i = 0; i < 3; i++){
+        if(args[i]){
+            remove_entry(string(args[i]), 0, 1, starting_directory, starting_cluster, chains, dblock, fblock);
+        }
+    }
+    fblock.free_chains(chains);
+}
 
-    int file_name_size = path.size() - last_backward_slash;
+// IMPORT
+struct Import_Node{
+    string name;
+    string host_path;
+    int is_folder;
+    uint64_t size;
+    vector<Import_Node> children;
+    vector<int> clusters; // Allocated chain
+};
 
-    for(int i = 0; i < last_backward_slash; i++){
-        path += arg1[i];
+int walk_host_tree(Import_Node &node){
+    // Stage 1: read the host directory tree into nodes. Only directories and regular files
+    // that fit into 32 bit fileSize are taken. Children are sorted by name.
+    DIR *dir = opendir(node.host_path.c_str());
+    if(!dir){
+        return -1;
     }
-    for(int i = last_backward_slash+1; i < arg1.size(); i++){
-        file += arg1[i];
+    struct dirent *host_entry;
+    while((host_entry = readdir(dir)) != NULL){
+        string name = host_entry->d_name;
+        if(name == "." || name == ".."){
+            continue;
+        }
+        Import_Node child;
+        child.name = name;
+        child.host_path = node.host_path + "/" + name;
+        struct stat host_stat;
+        if(lstat(child.host_path.c_str(), &host_stat) == -1){
+            continue;
+        }
+        if(S_ISDIR(host_stat.st_mode)){
+            child.is_folder = 1;
+            child.size = 0;
+        }
+        else if(S_ISREG(host_stat.st_mode) && host_stat.st_size <= 0xFFFFFFFFLL){
+            child.is_folder = 0;
+            child.size = host_stat.st_size;
+        }
+        else{
+            continue;
+        }
+        node.children.push_back(child);
     }
-
-    // Case 4
-    if(path == ""){
-        path = ".";
+    closedir(dir);
+    sort(node.children.begin(), node.children.end(), [](const Import_Node &a, const Import_Node &b){
+        return a.name < b.name;
+    });
+    for(int i = 0; i < node.children.size(); i++){
+        if(node.children[i].is_folder){
+            walk_host_tree(node.children[i]);
+        }
     }
-
-    
+    return 0;
 }
-void cat(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
-    // From the pinput, get the path + file name.
-    // CD into path
-    // Read the file if exist
-
-    string current_directory = starting_directory;
-    int current_cluster = starting_cluster;
-
-    int total_fat_entries = dblock.get_cluster_size() / sizeof(FatFile83);
 
-    string path;
-    string file_name;
-    
-    string arg1 = string(pinput->arg1);
+int directory_entry_count(Import_Node &node){ // . and .. + LFN and 8.3 entries of each child
+    int count = 2;
+    for(int i = 0; i < node.children.size(); i++){
+        count += node.children[i].name.size()/13 + 2;
+    }
+    return count;
+}
 
-    seperate_path_file(path,file_name,arg1);
+int allocate_tree(Import_Node &node, unsigned int cluster_size, FAT_Block &fblock){
+    // Stage 2: allocate the chain of every directory and file before anything is written
+    uint64_t bytes = node.is_folder ? (uint64_t) directory_entry_count(node) * sizeof(FatFile83) : node.size;
+    unsigned int count = (bytes + cluster_size - 1) / cluster_size;
+    if(count > 0 && fblock.allocate_chain(count, node.clusters) == -1){
+        return -1;
+    }
+    for(int i = 0; i < node.children.size(); i++){
+        if(allocate_tree(node.children[i], cluster_size, fblock) == -1){
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    // We have both path and file.
+void free_tree(Import_Node &node, FAT_Block &fblock){ // Give back the clusters taken by allocate_tree
+    for(int i = 0; i < node.clusters.size(); i++){
+        fblock.write_to_fat(node.clusters[i], 0);
+    }
+    for(int i = 0; i < node.children.size(); i++){
+        free_tree(node.children[i], fblock);
+    }
+}
 
-    // CD into directory if possible
-    int path_exist = cd_(path,current_directory,current_cluster,dblock,fblock);
+#define WRITER_QUEUE_LIMIT 64 // Maximum number of runs waiting for the writer thread
 
-    if(path_exist == -1){
-        return;
-    } 
+class Cluster_Writer{
+    /*
+        Writes clusters to the image on a separate thread, so reading the host files and
+        building the directories overlap with the writes. Clusters that are added one after another
+        and are consecutive in the image are collected into one run and written with one call.
+    */
+    struct Write_Run{
+        int index;
+        int count;
+        vector<char> data;
+    };
+    DATA_Block &dblock;
+    unsigned int cluster_size;
+    unsigned int max_run_clusters;
+    Write_Run pending; // Run that is being collected
+    deque<Write_Run> queue;
+    mutex queue_lock;
+    condition_variable queue_changed;
+    int finished = 0;
+    thread writer;
+
+    void write_loop(){
+        while(1){
+            Write_Run run;
+            {
+                unique_lock<mutex> lock(queue_lock);
+                queue_changed.wait(lock, [this]{ return !queue.empty() || finished; });
+                if(queue.empty()){
+                    return;
+                }
+                run = std::move(queue.front());
+                queue.pop_front();
+            }
+            queue_changed.notify_all();
+            dblock.store_clusters(run.index, run.count, run.data.data());
+        }
+    }
 
-    // Traverse each file. When the name is equal to the file_name, read it and output!
-    int break_loop = 0;
-    vector<FatFileLFN*> lfn_vec;
+    void submit_pending(){
+        if(pending.count == 0){
+            return;
+        }
+        dblock.discard_cached(pending.index, pending.count);
+        {
+            unique_lock<mutex> lock(queue_lock);
+            queue_changed.wait(lock, [this]{ return queue.size() < WRITER_QUEUE_LIMIT; });
+            queue.push_back(std::move(pending));
+        }
+        queue_changed.notify_all();
+        pending = Write_Run();
+        pending.count = 0;
+    }
 
-    for(int traverse_cluster = current_cluster; traverse_cluster < END_CLUSTER; traverse_cluster = fblock.get_from_fat(traverse_cluster)){
-        void *cluster_pointer = dblock.get_from_dblock(traverse_cluster);
-        // LFN entries come first.
-        int i = 0;
-        if(current_cluster != ROOT_DIRECTORY && current_cluster == traverse_cluster ){
-            i = 2;
-        }
-        for(; i < total_fat_entries; i++){    
-            // If not the root, we have to start from 2, else start from 0
-            FatFileLFN* traverse_pointer = (FatFileLFN *) cluster_pointer;
-            traverse_pointer += i;
+    public:
+        Cluster_Writer(DATA_Block &dblock_) : dblock(dblock_){
+            cluster_size = dblock.get_cluster_size();
+            max_run_clusters = IO_BUFFER_SIZE / cluster_size > 0 ? IO_BUFFER_SIZE / cluster_size : 1;
+            pending.count = 0;
+            writer = thread(&Cluster_Writer::write_loop, this);
+        }
 
-            if(traverse_pointer->sequence_number == 0x00){
-                free(cluster_pointer);
-                return ;
+        void add(int index, const char *data){ // data is one cluster
+            if(pending.count > 0 && (index != pending.index + pending.count || pending.count >= max_run_clusters)){
+                submit_pending();
             }
-            else if(traverse_pointer->sequence_number == 0xE5){
-                continue;
+            if(pending.count == 0){
+                pending.index = index;
+                pending.data.reserve((size_t) max_run_clusters * cluster_size);
             }
-            else if(traverse_pointer->sequence_number == 0x2E){
-                continue;
+            pending.data.insert(pending.data.end(), data, data + cluster_size);
+            pending.count++;
+        }
+
+        void finish(){ // Write everything and stop the thread
+            submit_pending();
+            {
+                lock_guard<mutex> lock(queue_lock);
+                finished = 1;
             }
+            queue_changed.notify_all();
+            writer.join();
+        }
+};
 
-            else if(traverse_pointer)
-            lfn_vec.push_back(traverse_pointer);
-            int next_true_entry = (static_cast<int>(traverse_pointer->sequence_number) == 1) || (static_cast<int>(traverse_pointer->sequence_number) == 65);
-            
-            //cout << " i : " << i << " lfn "  << !next_true_entry << endl; 
-            if(next_true_entry){
-                //Now we are at true FatFile83 directory entry
-                //Extract the name from the stack
-                // Concatanate them to get the filneame
-                // Compare it with the target
-                // If true, calculate the next cluster index
-                // Go to that cluster and continue looping!
-                //cout << "Index : i -> " << i << endl;
-                FatFile83 *true_entry = (FatFile83 *) cluster_pointer;
-                true_entry += (i+1);
-                string concat_file_name = "";
-                next_true_entry = 0;
-                int end_reached = 0;
-                
-                for(int i2 = 1; i2 < lfn_vec.size(); i2++){
-                    FatFileLFN* dummy = lfn_vec[i2];
-                    for(int j = 0; j < 5; j++){
-                        if(dummy->name1[j] == '\0'){
-                            end_reached = 1;
-                        }   
-                        if(end_reached){
-                            break;
-                        }
-                        concat_file_name += dummy->name1[j]; 
+void pack_directory(Import_Node &node, int parent_cluster, unsigned int cluster_size, vector<char> &buffer){
+    // All entries of the directory are packed into its clusters in one pass.
+    // Root directory has no . and .. entries.
+    buffer.assign(node.clusters.size() * cluster_size, 0);
+    FatFile83 *entries = (FatFile83 *) buffer.data();
+    int position = 0;
+    if(node.clusters[0] != ROOT_DIRECTORY){
+        entries[position++] = create_entry(-1, node.clusters[0], 1); // point to current
+        entries[position++] = create_entry(0, parent_cluster, 1); // point to parent
+    }
+    for(int i = 0; i < node.children.size(); i++){
+        Import_Node &child = node.children[i];
+        int entry_required = child.name.size()/13 + 2;
+        vector<FatFileLFN> lfn_list(entry_required-1);
+        create_lfn_list(lfn_list, child.name);
+        uint32_t first_cluster = child.clusters.empty() ? 0 : child.clusters[0];
+        FatFile83 f83_entry = create_entry(i + 1, first_cluster, child.is_folder);
+        f83_entry.fileSize = child.is_folder ? 0 : child.size;
+        set_lfn_checksum(lfn_list, f83_entry);
+        for(int j = 0; j < lfn_list.size(); j++){
+            *((FatFileLFN *) &entries[position++]) = lfn_list[j];
+        }
+        entries[position++] = f83_entry;
+    }
+}
 
-                    }
+void write_tree(Import_Node &node, int parent_cluster, Cluster_Writer &writer, unsigned int cluster_size, vector<char> &buffer){
+    // Stage 3: build the contents of the node and hand its clusters to the writer.
+    // Files are read through buffer, which is a whole number of clusters and is given by the caller.
+    if(node.is_folder){
+        vector<char> directory_buffer;
+        pack_directory(node, parent_cluster, cluster_size, directory_buffer);
+        for(int k = 0; k < node.clusters.size(); k++){
+            writer.add(node.clusters[k], directory_buffer.data() + (size_t) k * cluster_size);
+        }
+        for(int i = 0; i < node.children.size(); i++){
+            write_tree(node.children[i], node.clusters[0], writer, cluster_size, buffer);
+        }
+        return;
+    }
 
-                    for(int j = 0; j < 6; j++){
-                        if(dummy->name2[j] == '\0'){
-                            end_reached = 1;
-                        }   
-                        if(end_reached){
-                            break;
-                        }    
-                        concat_file_name += dummy->name2[j];    
-                    }
+    if(node.clusters.empty()){
+        return;
+    }
+    int host_fd = open(node.host_path.c_str(), O_RDONLY);
+    uint64_t host_offset = 0;
+    int k = 0;
+    while(k < node.clusters.size()){
+        size_t filled = 0;
+        while(host_fd >= 0 && filled < buffer.size()){
+            ssize_t r = count_io(pread(host_fd, buffer.data() + filled, buffer.size() - filled, host_offset + filled), IO_READ);
+            if(r < 0 && errno == EINTR){
+                continue;
+            }
+            if(r <= 0){
+                break;
+            }
+            filled += r;
+        }
+        memset(buffer.data() + filled, 0, buffer.size() - filled); // file is shorter or could not be read
+        for(size_t done = 0; done < buffer.size() && k < node.clusters.size(); done += cluster_size){
+            writer.add(node.clusters[k++], buffer.data() + done);
+        }
+        host_offset += buffer.size();
+    }
+    if(host_fd >= 0){
+        close(host_fd);
+    }
+}
 
-                    for(int j = 0; j < 2; j++){
-                        if(dummy->name3[j] == '\0'){
-                            end_reached = 1;
-                        }   
-                        if(end_reached){
-                            break;
-                        }   
-                        concat_file_name += dummy->name3[j];    
-                    }
-                }
-                FatFileLFN* dummy = lfn_vec[0];
-                for(int j = 0; j < 5; j++){ 
-                    if(dummy->name1[j] == '\0'){
-                        end_reached = 1;
-                    }   
-                    if(end_reached){
-                        break;
-                    } 
-                    concat_file_name += dummy->name1[j];    
-                }
+void import_tree(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // import -r <host-dir> <image-dir> : copy host-dir with everything under it into image-dir
+    if(!pinput->arg1 || string(pinput->arg1) != "-r" || !pinput->arg2 || !pinput->arg3){
+        return;
+    }
+    Import_Node root;
+    root.host_path = pinput->arg2;
+    while(root.host_path.size() > 1 && root.host_path.back() == '/'){
+        root.host_path.pop_back();
+    }
+    size_t last_slash = root.host_path.find_last_of('/');
+    root.name = last_slash == string::npos ? root.host_path : root.host_path.substr(last_slash + 1);
+    root.is_folder = 1;
+    root.size = 0;
 
-                for(int j = 0; j < 6; j++){
-                    if(dummy->name2[j] == '\0'){
-                        end_reached = 1;
-                    }   
-                    if(end_reached){
-                        break;
-                    } 
-                    concat_file_name += dummy->name2[j];    
-                }
+    // Target directory should exist and should not have an entry with the same name
+    string target = pinput->arg3;
+    string current_directory = starting_directory;
+    int current_cluster = starting_cluster;
+    Dir_Record record;
+    if(root.name == "" || cd_(target, current_directory, current_cluster, dblock, fblock) == -1 ||
+       name_index.lookup(current_cluster, root.name, record, dblock, fblock)){
+        return;
+    }
+    if(walk_host_tree(root) == -1){
+        return;
+    }
 
-                for(int j = 0; j < 2; j++){
-                    if(dummy->name3[j] == '\0'){
-                        end_reached = 1;
-                    }   
-                    if(end_reached){
-                        break;
-                    } 
-                    concat_file_name += dummy->name3[j];    
-                }
+    unsigned int cluster_size = dblock.get_cluster_size();
+    if(allocate_tree(root, cluster_size, fblock) == -1){
+        free_tree(root, fblock);
+        return; // not enough space
+    }
 
-                while(lfn_vec.size()){ // remove each element
-                    lfn_vec.pop_back();
-                }
+    Cluster_Writer writer(dblock);
+    vector<char> file_buffer(IO_BUFFER_SIZE > cluster_size ? IO_BUFFER_SIZE - IO_BUFFER_SIZE % cluster_size : cluster_size);
+    write_tree(root, current_cluster, writer, cluster_size, file_buffer);
+    writer.finish();
 
-                if(true_entry->attributes == 0x10){
-                    continue; // if directory, continue
-                }
+    // Finally, link the tree to the target directory
+    string entry_path = child_path(current_directory, root.name);
+    if(add_entry(entry_path, starting_directory, starting_cluster, root.clusters[0], 0, 1, dblock, fblock) == -1){
+        free_tree(root, fblock);
+    }
+}
 
-                //cout << "Files : " << concat_file_name << endl;
-                //cout << concat_file_name.size() << next_path.size() << endl;
-                if(concat_file_name == file_name){
-                    // we have the entry
-                    //cout << "Current cluster was" << current_cluster  << endl;
+// JOURNAL
+#define JOURNAL_MAGIC "HW3JRNL1"
+#define JOURNAL_HEADER_SIZE 512 // Records start after the header sector
+#define JOURNAL_GROUP_SIZE 256 // Operations that are committed together at most
+
+struct Journal_Header{
+    char magic[8];
+    uint64_t sequence; // Number of the commit, only informational
+    uint64_t record_count;
+    uint64_t payload_size; // Bytes of the records after the header
+    uint64_t checksum; // FNV-1a of the records, a journal that does not match was not committed
+};
 
-                    //cout << true_entry->eaIndex << " and " << true_entry->firstCluster << endl;
-                    current_cluster = (true_entry->eaIndex << 16) + true_entry->firstCluster;
-                    if(current_cluster == 0){
-                        current_cluster = 2;
-                    }
-                    //cout << "Current cluster is" << current_cluster  << endl;
-                    // First cluster is found. Read the content and switch cluster with FAT table!
-                    read_cluster(current_cluster, fblock, dblock);
-                    break_loop = 1;
+struct Journal_Record{ // Followed by length bytes that belong to offset of the image
+    uint64_t offset;
+    uint64_t length;
+};
 
-                }
+uint64_t journal_checksum(const char *data, uint64_t size){ // 64-bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for(uint64_t i = 0; i < size; i++){
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 
-            }
-            if(break_loop){
+int replay_journal(int image_fd, const string &journal_path){
+    // Apply the records of a committed journal to the image and empty the journal. It is called before the image
+    // is read, the records of a commit that crashed before it reached the image are written again.
+    // A journal that is cut short or does not match its checksum is ignored. Returns the number of records applied.
+    int journal_fd = open(journal_path.c_str(), O_RDWR);
+    if(journal_fd == -1){
+        return 0;
+    }
+    struct stat journal_stat;
+    fstat(journal_fd, &journal_stat);
+    Journal_Header header;
+    int applied = 0;
+    if(journal_stat.st_size >= JOURNAL_HEADER_SIZE && pread(journal_fd, &header, sizeof(header), 0) == sizeof(header) &&
+       !memcmp(header.magic, JOURNAL_MAGIC, 8) && header.payload_size <= (uint64_t) journal_stat.st_size - JOURNAL_HEADER_SIZE){
+        vector<char> payload(header.payload_size);
+        uint64_t done = 0;
+        while(done < header.payload_size){
+            ssize_t r = pread(journal_fd, payload.data() + done, header.payload_size - done, JOURNAL_HEADER_SIZE + done);
+            if(r <= 0){
                 break;
             }
+            done += r;
         }
-        if(break_loop){
-            break;
+        if(done == header.payload_size && journal_checksum(payload.data(), payload.size()) == header.checksum){
+            uint64_t position = 0;
+            for(uint64_t i = 0; i < header.record_count && position + sizeof(Journal_Record) <= payload.size(); i++){
+                Journal_Record record;
+                memcpy(&record, payload.data() + position, sizeof(record));
+                position += sizeof(record);
+                if(record.length > payload.size() - position){
+                    break;
+                }
+                count_io(pwrite(image_fd, payload.data() + position, record.length, record.offset), IO_WRITE);
+                position += record.length;
+                applied++;
+            }
+            fdatasync(image_fd);
         }
     }
-
+    ftruncate(journal_fd, 0);
+    close(journal_fd);
+    return applied;
 }
 
-int allocate_free_cluster(DATA_Block &dblock, FAT_Block &fblock){
-    int EMPTY_FOUND = 0;
-    int i = 0;
-    while(!EMPTY_FOUND){
-        if(fblock.get_from_fat(i) == 0){
-            EMPTY_FOUND = 1;
-            break;
+class Journal{
+    /*
+        Intent log of the metadata changes, kept in <image>.journal next to the image (-j).
+        Changed directory clusters stay in the cluster cache and changed FAT sectors in the FAT table
+        until a commit. A commit writes all of them to the journal and syncs it once, so every operation
+        since the previous commit shares a single fdatasync (group commit). Then they are written to
+        their places on the image and the journal is emptied.
+        File contents are written to newly allocated clusters directly, they are synced before the
+        journal, so committed metadata never points to contents that are not on the image. Clusters
+        that are freed are not reused until the commit for the same reason.
+    */
+    int journal_fd = -1;
+    int image_fd = -1;
+    uint64_t sequence = 0;
+    atomic<int> operations{0}; // Operations since the last commit
+
+    public:
+        Journal(){}
+        Journal(const Journal &) = delete;
+        Journal& operator=(const Journal &) = delete;
+        ~Journal(){
+            if(journal_fd != -1){
+                close(journal_fd);
+            }
         }
-        i++;
-    }
-    return i;
 
-}
+        int open_journal(const string &path, int image_fd_){ // Returns -1 if the journal can not be created
+            journal_fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            image_fd = image_fd_;
+            return journal_fd == -1 ? -1 : 0;
+        }
 
+        int enabled(){
+            return journal_fd != -1;
+        }
 
-unsigned char lfn_checksum(unsigned char *fname)
-{
-   int i;
-   unsigned char sum = 0;
+        void add_operation(){
+            operations++;
+        }
 
-   for (i = 11; i; i--)
-      sum = ((sum & 1) << 7) + (sum >> 1) + *fname++;
+        int needs_commit(DATA_Block &dblock){
+            // A group is committed when it is large enough, or when the dirty clusters fill half of the cache
+            return operations >= JOURNAL_GROUP_SIZE || dblock.get_dirty_count() * 2 >= dblock.get_cache_capacity();
+        }
 
-   return sum;
-}
+        void commit(DATA_Block &dblock, FAT_Block &fblock){
+            // Nothing else should modify the blocks during the commit
+            fblock.release_deferred();
+            vector<Io_Request> writes;
+            dblock.collect_writes(writes);
+            fblock.collect_writes(writes);
+            operations = 0;
+            if(writes.empty()){
+                return;
+            }
+            if(dblock.take_data_written()){ // file contents first
+                fdatasync(image_fd);
+            }
 
- 
-void create_lfn_list(vector<FatFileLFN> &lfn_list,string folder_name){
+            // The records are put one after another, the header is written with them
+            vector<char> payload;
+            for(int i = 0; i < writes.size(); i++){
+                Journal_Record record;
+                record.offset = writes[i].offset;
+                record.length = 0;
+                for(int j = 0; j < writes[i].vectors.size(); j++){
+                    record.length += writes[i].vectors[j].iov_len;
+                }
+                payload.insert(payload.end(), (char *) &record, (char *) &record + sizeof(record));
+                for(int j = 0; j < writes[i].vectors.size(); j++){
+                    char *data = (char *) writes[i].vectors[j].iov_base;
+                    payload.insert(payload.end(), data, data + writes[i].vectors[j].iov_len);
+                }
+            }
+            char header_sector[JOURNAL_HEADER_SIZE] = {0};
+            Journal_Header header;
+            memcpy(header.magic, JOURNAL_MAGIC, 8);
+            header.sequence = ++sequence;
+            header.record_count = writes.size();
+            header.payload_size = payload.size();
+            header.checksum = journal_checksum(payload.data(), payload.size());
+            memcpy(header_sector, &header, sizeof(header));
+            Io_Request request;
+            request.direction = IO_WRITE;
+            request.offset = 0;
+            request.vectors.push_back({header_sector, JOURNAL_HEADER_SIZE});
+            request.vectors.push_back({payload.data(), payload.size()});
+            if(complete_request(journal_fd, request, 0) == -1){
+                cerr << "hw3: can not write the journal" << endl; // the changes are still written to the image below
+            }
+            fdatasync(journal_fd); // the commit point of the group
 
-    int lfn_size = lfn_list.size();
-    unsigned char *fname = new unsigned char[lfn_size + 1];
-    for(int i = 0; i < lfn_size; i++){
-        fname[i] = folder_name[i];
+            dblock.write_back();
+            fblock.flush();
+            fdatasync(image_fd);
+            ftruncate(journal_fd, 0); // a journal left by a crash after this point is applied again, which is harmless
+        }
+};
+
+Journal journal;
+
+void sync_image(DATA_Block &dblock, FAT_Block &fblock){
+    // Write the cached clusters and FAT sectors back to the image, through the journal if it is enabled
+    if(journal.enabled()){
+        journal.commit(dblock, fblock);
+        return;
     }
-    fname[lfn_size] = '\0';
-    unsigned checksum = lfn_checksum(fname);
-    int i;
-    for(i = 0; i < lfn_size - 1; i++){
-        FatFileLFN* fat_file = new FatFileLFN();
+    dblock.flush();
+    fblock.flush();
+}
 
-        fat_file->sequence_number = lfn_size - (i+1);
-        fat_file->attributes = 0x0F;
-        fat_file->reserved = 0x00;
-        fat_file->firstCluster = 0x0000;
-        fat_file->checksum =checksum;
+// FIND AND DU
+int worker_count(){ // Number of threads used by the parallel commands
+    int count = thread::hardware_concurrency();
+    return count < 1 ? 1 : count;
+}
 
-        for(int j = 0; j < 5; j++){
-            //cout << "name1 -> " << j + 13*i << " written " << folder_name[j + 13*i] << endl;
-            fat_file->name1[j] = folder_name[j + 13*i];
+void parallel_for(uint64_t begin, uint64_t end, const function<void(uint64_t, uint64_t, int)> &body){
+    // Split [begin, end) into one range per thread and run body(range begin, range end, thread id) on each
+    int thread_count = worker_count();
+    uint64_t step = (end - begin + thread_count - 1) / thread_count;
+    vector<thread> threads;
+    for(int i = 1; i < thread_count; i++){
+        uint64_t range_begin = min(end, begin + step * i);
+        uint64_t range_end = min(end, range_begin + step);
+        threads.push_back(thread(body, range_begin, range_end, i));
+    }
+    body(begin, min(end, begin + step), 0);
+    for(int i = 0; i < threads.size(); i++){
+        threads[i].join();
+    }
+}
 
+struct Walk_Entry{
+    string path;
+    int is_folder;
+    uint64_t size; // fileSize of files
+    uint64_t allocated; // Bytes in the clusters of the entry
+    Dir_Record record; // Entry in the parent directory, entry_cluster is -1 for the directory the walk starts from
+};
+
+class Tree_Walker{
+    /*
+        Walks a directory tree with a pool of threads. Each thread takes a directory from the queue,
+        reads its chain (from the image or the mapping), decodes the entries and queues its subdirectories.
+        Entries are collected in a buffer per thread and the buffers are merged when the walk ends.
+        If a filter is set, it is called on the walking thread with the thread id and only the entries
+        it returns 1 for are collected.
+        The threads only read the FAT array and the image, so the cluster cache should be flushed before the walk.
+    */
+    struct Walk_Task{
+        int cluster;
+        string path;
+        Dir_Record record;
+    };
+    DATA_Block &dblock;
+    FAT_Block &fblock;
+    const char *pattern; // Only entries with a matching name are kept, NULL keeps everything
+    function<int(Walk_Entry &, int)> filter;
+    unsigned int cluster_size;
+    deque<Walk_Task> tasks;
+    unordered_set<int> visited; // Directories that are queued, a directory pointing to its ancestor is not walked again
+    int active = 0; // Number of threads processing a directory
+    mutex task_lock;
+    condition_variable task_added;
+    vector<vector<Walk_Entry>> results; // One buffer per thread
+
+    int matches(const string &path){
+        if(!pattern){
+            return 1;
         }
-        for(int j = 0; j < 6; j++){
-            //cout << "name2 -> " << j + 5 + 13*i << " written " << folder_name[j + 5 + 13*i] << endl;
-            fat_file->name2[j] = folder_name[j + 5 + 13*i];
-                       
-        }
-        for(int j = 0; j < 2; j++){
-            //cout << "name3 -> " << j + 11 + 13*i << " written " << folder_name[j + 11 + 13*i] << endl;
-            fat_file->name3[j] = folder_name[j + 11 + 13*i];
-        }
-        // calculate checkum here
-        lfn_list[i+1] = *(fat_file);
+        string name = path.substr(path.find_last_of('/') + 1);
+        return fnmatch(pattern, name.c_str(), 0) == 0;
+    }
 
+    void add_entry(Walk_Entry &&entry, int id){
+        if(!filter || filter(entry, id)){
+            results[id].push_back(std::move(entry));
+        }
     }
-    FatFileLFN* fat_file = new FatFileLFN();
 
-    fat_file->sequence_number = 0x41 + lfn_size - 1;
-    fat_file->attributes = 0x0F;
-    fat_file->reserved = 0x00;
-    fat_file->firstCluster = 0x0000;
+    void walk_directory(Walk_Task &task, int id, char *buffer){
+        vector<pair<int,int>> runs;
+        uint64_t chain_bytes = (uint64_t) cluster_size * (fblock.get_entry_count() + 1); // bounded by the FAT, stops loops
+        get_cluster_runs(task.cluster, chain_bytes, cluster_size, fblock, runs);
+
+        vector<Dir_Record> records;
+        Entry_Decoder decoder;
+        int total_fat_entries = cluster_size / sizeof(FatFile83);
+        int directory_clusters = 0;
+        int end_reached = 0;
+        int buffer_clusters = IO_BUFFER_SIZE / cluster_size;
+        size_t run = 0;
+        int used = 0;
+        vector<pair<int,int>> pieces;
+        while(run < runs.size() && !end_reached){
+            // Runs are decoded from the mapping, or read into the buffer of the thread a batch at a time
+            const char *data = dblock.get_mapped(runs[run].first);
+            pieces.clear();
+            if(data){
+                pieces.push_back(runs[run++]);
+            }
+            else{
+                take_runs(runs, run, used, buffer_clusters, pieces);
+                dblock.load_runs(pieces, buffer);
+                data = buffer;
+            }
+            for(int p = 0; p < pieces.size() && !end_reached; p++){
+                directory_clusters += pieces[p].second;
+                for(int k = 0; k < pieces[p].second && !end_reached; k++){
+                    end_reached = !decoder.decode(data, total_fat_entries, pieces[p].first + k, records);
+                    data += cluster_size;
+                }
+            }
+        }
+        if(matches(task.path)){
+            add_entry({task.path, 1, 0, (uint64_t) directory_clusters * cluster_size, task.record}, id);
+        }
 
-    int character_left = (folder_name.size() % 13) + 1; 
-    //cout << "Character left for lfn1 : " << character_left << endl;  
-    if(character_left <= 13){
-        for(int j = 0; j < 5; j++){
-            if(character_left <= 0){
-                break;
+        vector<Walk_Task> subdirectories;
+        for(int i = 0; i < records.size(); i++){
+            string path = child_path(task.path, records[i].name);
+            if(records[i].attributes & 0x10){
+                if(records[i].first_cluster >= ROOT_DIRECTORY && records[i].first_cluster < END_CLUSTER){
+                    subdirectories.push_back({(int) records[i].first_cluster, path, records[i]});
+                }
             }
-            if(character_left-- == 1){
-                fat_file->name1[j] = '\0';
+            else if(matches(path)){
+                uint64_t allocated = ((uint64_t) records[i].file_size + cluster_size - 1) / cluster_size * cluster_size;
+                add_entry({path, 0, records[i].file_size, allocated, records[i]}, id);
             }
-            fat_file->name1[j] = folder_name[j + 13*i];
+        }
+        if(!subdirectories.empty()){
+            {
+                lock_guard<mutex> lock(task_lock);
+                for(int i = 0; i < subdirectories.size(); i++){
+                    if(visited.insert(subdirectories[i].cluster).second){
+                        tasks.push_back(std::move(subdirectories[i]));
+                    }
+                }
+            }
+            task_added.notify_all();
         }
     }
-    
-    if(character_left <= 8){
-        for(int j = 0; j < 6; j++){
-            if(character_left <= 0){
-                break;
+
+    void worker(int id){
+        char *buffer = io_ring().get_buffer();
+        while(1){
+            Walk_Task task;
+            {
+                unique_lock<mutex> lock(task_lock);
+                task_added.wait(lock, [this]{ return !tasks.empty() || active == 0; });
+                if(tasks.empty()){
+                    return; // nothing queued and nobody can queue more
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+                active++;
             }
-            if(character_left-- == 1){
-                fat_file->name2[j] = '\0';
+            walk_directory(task, id, buffer);
+            {
+                lock_guard<mutex> lock(task_lock);
+                active--;
             }
-            fat_file->name2[j] = folder_name[j + 5 + 13*i];
+            task_added.notify_all();
         }
     }
-    if(character_left <= 2){
-        for(int j = 0; j < 2; j++){
-            if(character_left <= 0){
-                break;
+
+    public:
+        Tree_Walker(DATA_Block &dblock_, FAT_Block &fblock_, const char *pattern_ = NULL) : dblock(dblock_), fblock(fblock_), pattern(pattern_){
+            cluster_size = dblock.get_cluster_size();
+        }
+
+        void set_filter(const function<int(Walk_Entry &, int)> &filter_){
+            filter = filter_;
+        }
+
+        void walk(int directory_cluster, string directory_path, vector<Walk_Entry> &entries){
+            int thread_count = worker_count();
+            results.assign(thread_count, vector<Walk_Entry>());
+            Dir_Record record;
+            record.name = directory_path;
+            record.first_cluster = directory_cluster;
+            record.attributes = 0x10;
+            record.file_size = 0;
+            record.entry_cluster = record.entry_index = record.lfn_cluster = record.lfn_index = -1;
+            record.entry_count = 0;
+            record.checksum_ok = 1;
+            tasks.push_back({directory_cluster, directory_path, record});
+            visited.clear();
+            visited.insert(directory_cluster);
+            active = 0;
+            vector<thread> threads;
+            for(int i = 1; i < thread_count; i++){
+                threads.push_back(thread(&Tree_Walker::worker, this, i));
             }
-            if(character_left-- == 1){
-                fat_file->name3[j] = '\0';
+            worker(0);
+            for(int i = 0; i < threads.size(); i++){
+                threads[i].join();
+            }
+            for(int i = 0; i < thread_count; i++){
+                entries.insert(entries.end(), make_move_iterator(results[i].begin()), make_move_iterator(results[i].end()));
+                results[i].clear();
             }
-            fat_file->name3[j] = folder_name[j + 11 + 13*i];
         }
+};
+
+int walk_tree(string directory, string starting_directory, int starting_cluster, const char *pattern, vector<Walk_Entry> &entries, DATA_Block &dblock, FAT_Block &fblock){
+    // Collect the entries under directory. Returns -1 if the directory does not exist.
+    if(cd_(directory, starting_directory, starting_cluster, dblock, fblock) == -1){
+        return -1;
     }
-    
-    // calculate checkum here
-    fat_file->checksum = checksum;
-    lfn_list[0] = *(fat_file);
-    
+    sync_image(dblock, fblock); // the threads read the image, not the cache
+    Tree_Walker walker(dblock, fblock, pattern);
+    walker.walk(starting_cluster, starting_directory, entries);
+    return 0;
 }
 
-
-FatFile83 create_entry(int file_position, uint32_t new_cluster_index, int isFolder)
-{
-
-    FatFile83 directory_entry;
-    memset(&directory_entry, 0x20, sizeof(FatFile83));
-    string file_name;
-    if(file_position == -1){ // .
-        file_name = ".";
+void find(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // find <dir> [-name <pattern>] : print the paths under dir, only the ones with a matching name if pattern is given
+    string directory = pinput->arg1 ? pinput->arg1 : ".";
+    const char *pattern = NULL;
+    if(pinput->arg2){
+        if(string(pinput->arg2) != "-name" || !pinput->arg3){
+            return;
+        }
+        pattern = pinput->arg3;
     }
-    else if(file_position == 0){
-        file_name = "..";
+    vector<Walk_Entry> entries;
+    if(walk_tree(directory, starting_directory, starting_cluster, pattern, entries, dblock, fblock) == -1){
+        return;
     }
-    else{    
-        file_name = "~" + to_string(file_position);
+    sort(entries.begin(), entries.end(), [](const Walk_Entry &a, const Walk_Entry &b){
+        return a.path < b.path;
+    });
+    string output;
+    for(int i = 0; i < entries.size(); i++){
+        output += entries[i].path;
+        output += '\n';
     }
+    write_output(output.data(), output.size());
+}
 
-    directory_entry.firstCluster = new_cluster_index & 0xFFFF;
-    directory_entry.eaIndex = new_cluster_index & 0xFFFF0000;
-    directory_entry.fileSize = 0;
-
+string parent_of(const string &path){ // Parent path of an absolute path, "/" has no parent
+    size_t last_slash = path.find_last_of('/');
+    return last_slash == 0 ? "/" : path.substr(0, last_slash);
+}
 
-    // copy the names
-    for (int i = 0; i < file_name.size(); i++)
-    {
-        directory_entry.filename[i] = file_name[i];
+void du(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // du <dir> : print the space used by each directory under dir, in KB, including everything below it
+    string directory = pinput->arg1 ? pinput->arg1 : ".";
+    vector<Walk_Entry> entries;
+    if(walk_tree(directory, starting_directory, starting_cluster, NULL, entries, dblock, fblock) == -1){
+        return;
+    }
+    unordered_map<string, uint64_t> totals;
+    vector<string> directories;
+    for(int i = 0; i < entries.size(); i++){
+        if(entries[i].is_folder){
+            totals[entries[i].path] += entries[i].allocated;
+            directories.push_back(entries[i].path);
+        }
+    }
+    for(int i = 0; i < entries.size(); i++){
+        if(!entries[i].is_folder){
+            totals[parent_of(entries[i].path)] += entries[i].allocated;
+        }
     }
+    // Add every directory to its parent, deepest directories first
+    sort(directories.begin(), directories.end(), [](const string &a, const string &b){
+        return count(a.begin(), a.end(), '/') > count(b.begin(), b.end(), '/');
+    });
+    for(int i = 0; i < directories.size(); i++){
+        if(directories[i] == "/"){
+            continue;
+        }
+        auto parent = totals.find(parent_of(directories[i]));
+        if(parent != totals.end()){
+            parent->second += totals[directories[i]];
+        }
+    }
+    sort(directories.begin(), directories.end());
+    string output;
+    for(int i = 0; i < directories.size(); i++){
+        output += to_string((totals[directories[i]] + 1023) / 1024) + "\t" + directories[i] + "\n";
+    }
+    write_output(output.data(), output.size());
+}
 
+// CHECK
+struct Check_Result{ // Problems found by one thread
+    vector<string> messages;
+    vector<int> size_mismatches; // Indexes of the entries
+    vector<int> bad_checksums;
+    vector<int> lost_clusters;
+    uint64_t lost_chain_count = 0;
+};
 
-    if(isFolder){
-        directory_entry.attributes = 0x10;
+void fix_chain_length(Walk_Entry &entry, unsigned int chain_length, unsigned int cluster_size, DATA_Block &dblock, FAT_Block &fblock){
+    // Cut the chain if it is longer than fileSize needs, otherwise shrink fileSize to the chain
+    uint64_t needed = ((uint64_t) entry.record.file_size + cluster_size - 1) / cluster_size;
+    Cluster_Handle entry_handle = dblock.get_from_dblock(entry.record.entry_cluster);
+    FatFile83 *f83_entry = (FatFile83 *) entry_handle.data() + entry.record.entry_index;
+    if(chain_length < needed){
+        f83_entry->fileSize = (uint64_t) chain_length * cluster_size;
+        entry_handle.mark_dirty();
+        return;
+    }
+    int cluster = entry.record.first_cluster;
+    int rest;
+    if(needed == 0){
+        rest = cluster;
+        f83_entry->firstCluster = 0;
+        f83_entry->eaIndex = 0;
+        entry_handle.mark_dirty();
     }
     else{
-        directory_entry.attributes = 0x20;
+        for(unsigned int i = 1; i < needed; i++){
+            cluster = fblock.get_from_fat(cluster);
+        }
+        rest = fblock.get_from_fat(cluster);
+        fblock.write_to_fat(cluster, END_CLUSTER);
+    }
+    for(unsigned int i = needed; i < chain_length; i++){ // Only the clusters counted for this entry are freed
+        int next = fblock.get_from_fat(rest);
+        fblock.write_to_fat(rest, 0);
+        rest = next;
     }
-    directory_entry.reserved = 0x0;
-
-    time_t current_time = std::time(0);
-    struct tm * time_struct = std::localtime(&current_time);
-    directory_entry.creationTime = (time_struct->tm_hour << 11) | (time_struct->tm_min << 5) | (time_struct->tm_sec / 2);
-    directory_entry.modifiedTime = directory_entry.creationTime;
-
-    directory_entry.creationDate = ((time_struct->tm_year - 80) << 9) | ((time_struct->tm_mon) << 5) | time_struct->tm_mday;
-    directory_entry.modifiedDate = directory_entry.creationDate;
-
-    return directory_entry;
 }
 
-
-void mkdir(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
-    // A function of mkdir. First traverse to the path 
-    string current_directory = starting_directory;
-    int current_cluster = starting_cluster;
-
-    string temp_curr_directory = starting_directory;
-    int temp_curr_cluster = starting_cluster;
-
-    string temp2_curr_directory = starting_directory;
-    int temp2_curr_cluster = starting_cluster;
-
+void fix_lfn_checksum(Walk_Entry &entry, DATA_Block &dblock, FAT_Block &fblock){
+    // Write the checksum of the 8.3 name into every LFN entry of the run
+    Cluster_Handle entry_handle = dblock.get_from_dblock(entry.record.entry_cluster);
+    unsigned char checksum = lfn_checksum(((FatFile83 *) entry_handle.data() + entry.record.entry_index)->filename);
+    entry_handle.release();
     int total_fat_entries = dblock.get_cluster_size() / sizeof(FatFile83);
-
-    string path;
-    string folder_name;
-    
-    string path_parent;
-    string folder_parent_name;
-
-    string arg1 = string(pinput->arg1);
-
-    seperate_path_file(path,folder_name,arg1);
-    seperate_path_file(path_parent,folder_parent_name,path);
-
-
-    // CD into directory if possible
-    int path_exist = cd_(path,current_directory,current_cluster,dblock,fblock);
-
-    if(path_exist == -1){
-        return;
-    }   
-
-    int folder_exist = cd_(arg1,temp_curr_directory,temp_curr_cluster,dblock,fblock);
-
-    if(folder_exist != -1){ // if folder exist
-        return;
+    int cluster = entry.record.lfn_cluster;
+    int index = entry.record.lfn_index;
+    for(int i = 0; i < entry.record.entry_count - 1; i++){
+        if(index == total_fat_entries){ // run continues in the next cluster of the directory
+            cluster = fblock.get_from_fat(cluster);
+            index = 0;
+        }
+        Cluster_Handle lfn_handle = dblock.get_from_dblock(cluster);
+        ((FatFileLFN *) lfn_handle.data() + index)->checksum = checksum;
+        lfn_handle.mark_dirty();
+        index++;
     }
+}
 
-    // So now we are at the current directory and current cluster. We have to create folder
-    // Check whether there is a partial space in the cluster
-    int entry_required   = folder_name.size()/13 + 2; // if less than 13 : 1 LFN + 1 83
-    FatFileLFN* dest_pointer;
-    // Traverse the cluster and the next clusters using FAT table
-    int break_loop = 0;
-    int directory_index = -1;
-    int new_cluster_index = -1;
-    int cluster_traveled = 0;
-    int file_counter = 0;
-    int traverse_cluster;
-    int entry_index;
-    for(traverse_cluster = current_cluster; traverse_cluster < END_CLUSTER; traverse_cluster = fblock.get_from_fat(traverse_cluster)){
-        cluster_traveled++;
-        void *cluster_pointer = dblock.get_from_dblock(traverse_cluster);
-        vector<FatFileLFN*> lfn_vec;
-        // LFN entries come first.
-        int i = 0;
-        file_counter = 0;
-        for(; i < total_fat_entries; i++){    
-            // If not the root, we have to start from 2, else start from 0
-            FatFileLFN* traverse_pointer = (FatFileLFN *) cluster_pointer;
-            traverse_pointer += i;
-            int next_true_entry = (static_cast<int>(traverse_pointer->sequence_number) == 1) || (static_cast<int>(traverse_pointer->sequence_number) == 65);
-            if(next_true_entry){
-                file_counter++;
+void check(parsed_input *pinput, DATA_Block &dblock, FAT_Block &fblock){
+    // check [-r] : verify the FAT and the directory tree, -r repairs what can be repaired.
+    // The FAT scan (references and copies) and the tree walk run at the same time, then
+    // the chains of the entries are followed in parallel.
+    int repair = pinput->arg1 && string(pinput->arg1) == "-r";
+    sync_image(dblock, fblock);
+    unsigned int cluster_limit = fblock.get_cluster_limit();
+    unsigned int cluster_size = dblock.get_cluster_size();
+    int thread_count = worker_count();
+    vector<Check_Result> results(thread_count);
+
+    // Number of FAT entries pointing to each cluster, counting stops at 2
+    unique_ptr<atomic<uint8_t>[]> predecessors(new atomic<uint8_t>[cluster_limit]());
+    atomic<uint64_t> mirror_mismatches[256]; // NumFATs is one byte
+    thread fat_scan([&]{
+        parallel_for(ROOT_DIRECTORY, cluster_limit, [&](uint64_t begin, uint64_t end, int){
+            for(uint64_t cluster = begin; cluster < end; cluster++){
+                unsigned int next = fblock.get_from_fat(cluster);
+                if(next >= ROOT_DIRECTORY && next < cluster_limit && predecessors[next].load(memory_order_relaxed) < 2){
+                    predecessors[next].fetch_add(1, memory_order_relaxed);
+                }
+            }
+        });
+        unsigned int sector_count = fblock.get_fat_sector_count();
+        for(int copy = 1; copy < fblock.get_fat_count(); copy++){
+            mirror_mismatches[copy] = 0;
+            parallel_for(0, sector_count, [&](uint64_t begin, uint64_t end, int){
+                mirror_mismatches[copy] += fblock.compare_fat_copy(copy, begin, end - begin);
+            });
+        }
+    });
+    vector<Walk_Entry> entries;
+    Tree_Walker walker(dblock, fblock);
+    walker.walk(ROOT_DIRECTORY, "/", entries);
+    fat_scan.join();
+
+    // Give each cluster to the first entry that reaches it, an entry reaching an owned cluster is cross-linked
+    unique_ptr<atomic<uint32_t>[]> owners(new atomic<uint32_t>[cluster_limit]());
+    unique_ptr<atomic<uint8_t>[]> cross_linked(new atomic<uint8_t>[entries.size()]()); // Chains of these entries are not repaired
+    vector<unsigned int> chain_lengths(entries.size());
+    parallel_for(0, entries.size(), [&](uint64_t begin, uint64_t end, int id){
+        Check_Result &result = results[id];
+        for(uint64_t i = begin; i < end; i++){
+            Walk_Entry &entry = entries[i];
+            uint32_t owner = i + 1;
+            unsigned int length = 0;
+            unsigned int cluster = entry.record.first_cluster;
+            if(cluster != 0 && (cluster < ROOT_DIRECTORY || cluster >= cluster_limit)){
+                result.messages.push_back("invalid first cluster " + to_string(cluster) + ": " + entry.path);
             }
-            if(traverse_pointer->sequence_number == 0x00){
-                // After this entry, all entries are availible. 
-                dest_pointer = traverse_pointer ; // pointer to such index
-                entry_index = i; // entry index of the FAT table
-                if((total_fat_entries - i) >= entry_required){
-                    // We can insert it into this position. No more allocation needed
-                    break_loop = 1;
-                    
-                    int t_ = fblock.get_from_fat(traverse_cluster);
-                    int t_2 = t_ >= END_CLUSTER;
+            while(cluster >= ROOT_DIRECTORY && cluster < cluster_limit){
+                uint32_t expected = 0;
+                if(!owners[cluster].compare_exchange_strong(expected, owner)){
+                    if(expected == owner){
+                        result.messages.push_back("chain loops at cluster " + to_string(cluster) + ": " + entry.path);
+                    }
+                    else{
+                        string first = entries[expected - 1].path;
+                        string second = entry.path;
+                        if(second < first){
+                            swap(first, second);
+                        }
+                        result.messages.push_back("cross-linked cluster " + to_string(cluster) + ": " + first + ", " + second);
+                        cross_linked[i] = 1;
+                        cross_linked[expected - 1] = 1;
+                        // Count the rest of the chain for the size check, without taking the clusters
+                        for(unsigned int steps = 0; cluster >= ROOT_DIRECTORY && cluster < cluster_limit && steps < cluster_limit; steps++){
+                            length++;
+                            cluster = fblock.get_from_fat(cluster);
+                        }
+                    }
                     break;
-                    
                 }
-                else{
-                        // We need to create an empty cluster.
-                        // Write . and .. to the start 
-                        //  after we have reached the end of the cluster
-                        // we should move into the next one and start 
-                        // reading from first entry.
-                        new_cluster_index =  allocate_free_cluster(dblock,fblock); // a cluster for the directory
-                        fblock.write_to_fat(traverse_cluster, new_cluster_index);
-                        fblock.write_to_fat(new_cluster_index, END_CLUSTER);
-
-                        break_loop = 1;
-                        break;
+                length++;
+                cluster = fblock.get_from_fat(cluster);
+            }
+            chain_lengths[i] = length;
+            if(!entry.is_folder){
+                uint64_t needed = ((uint64_t) entry.record.file_size + cluster_size - 1) / cluster_size;
+                if(needed != length){
+                    result.messages.push_back("size mismatch: " + entry.path + " has " + to_string(entry.record.file_size) +
+                                              " bytes in " + to_string(length) + " clusters");
+                    result.size_mismatches.push_back(i);
                 }
-                free(cluster_pointer);
-                return ;
             }
-            else if(traverse_pointer->sequence_number == 0xE5){
-                // Skip the erased content
+            if(!entry.record.checksum_ok){
+                result.messages.push_back("bad LFN checksum: " + entry.path);
+                result.bad_checksums.push_back(i);
+            }
+        }
+    });
+
+    // Allocated clusters that no entry reaches are lost, the ones without a predecessor start a lost chain
+    parallel_for(ROOT_DIRECTORY, cluster_limit, [&](uint64_t begin, uint64_t end, int id){
+        Check_Result &result = results[id];
+        for(uint64_t cluster = begin; cluster < end; cluster++){
+            unsigned int value = fblock.get_from_fat(cluster);
+            if(value == 0 || value == 0x0FFFFFF7 || owners[cluster].load(memory_order_relaxed)){ // free, bad or reachable
                 continue;
             }
-            
-            if(break_loop){
-                break_loop = 0;
-                break;
+            result.lost_clusters.push_back(cluster);
+            if(predecessors[cluster].load(memory_order_relaxed) == 0){
+                result.lost_chain_count++;
             }
         }
-        if(break_loop){
-            break_loop = 0;
-            break;
+    });
+
+    vector<string> messages;
+    uint64_t lost_cluster_count = 0;
+    uint64_t lost_chain_count = 0;
+    for(int i = 0; i < thread_count; i++){
+        messages.insert(messages.end(), results[i].messages.begin(), results[i].messages.end());
+        lost_cluster_count += results[i].lost_clusters.size();
+        lost_chain_count += results[i].lost_chain_count;
+    }
+    sort(messages.begin(), messages.end());
+    if(lost_cluster_count){
+        messages.push_back("lost clusters: " + to_string(lost_cluster_count) + " in " + to_string(lost_chain_count) + " chains");
+    }
+    uint64_t mirror_problems = 0;
+    for(int copy = 1; copy < fblock.get_fat_count(); copy++){
+        if(mirror_mismatches[copy]){
+            messages.push_back("FAT copy " + to_string(copy) + " differs from FAT copy 0 in " + to_string(mirror_mismatches[copy].load()) + " sectors");
+            mirror_problems++;
         }
     }
-    // new_cluster_index is the index of the new block (empty cluster)
-    // dest_pointer points to the first empty directory entry
-    
-
-    // Open a cluster for our entry
-    int dir_entry_cluster = allocate_free_cluster(dblock,fblock);
-    fblock.write_to_fat(dir_entry_cluster,END_CLUSTER);
-
-    // Creat the LFN and 8.3 entries
-    // Fill the checksum, creation and modification date etc..
-    vector<FatFileLFN> lfn_list(entry_required-1);
-    FatFile83 f83_entry = create_entry(file_counter + 1,dir_entry_cluster,1);
-
-    // fill the empty dir_entry_cluster
-    // insert .  and .. entries
-
-    void *subdirectory_ptr = dblock.get_from_dblock(dir_entry_cluster);
-    FatFile83 *sub_ptr = (FatFile83 *) subdirectory_ptr;
-    FatFile83 cur_entry = create_entry(-1, dir_entry_cluster,1); // point to current
-    FatFile83 par_entry = create_entry(0, current_cluster,1); // point to parent
 
-    *sub_ptr = cur_entry;
-    *(sub_ptr + 1) = par_entry;
+    if(repair){
+        // Cross-linked clusters are only reported, it is not known which entry owns them
+        for(int i = 0; i < thread_count; i++){
+            for(int k = 0; k < results[i].size_mismatches.size(); k++){
+                int index = results[i].size_mismatches[k];
+                if(cross_linked[index]){
+                    continue;
+                }
+                fix_chain_length(entries[index], chain_lengths[index], cluster_size, dblock, fblock);
+            }
+            for(int k = 0; k < results[i].bad_checksums.size(); k++){
+                fix_lfn_checksum(entries[results[i].bad_checksums[k]], dblock, fblock);
+            }
+            for(int k = 0; k < results[i].lost_clusters.size(); k++){
+                fblock.write_to_fat(results[i].lost_clusters[k], 0);
+            }
+        }
+        if(mirror_problems){
+            fblock.mark_all_dirty();
+        }
+        name_index.clear(); // sizes and first clusters in the index may be changed
+        sync_image(dblock, fblock);
+    }
 
-    subdirectory_ptr = (void *) sub_ptr;
-    dblock.write_to_dblock(dir_entry_cluster,subdirectory_ptr);
-    
-    create_lfn_list(lfn_list,folder_name);  // fill out entries in lfn_list and f83_entry
+    string output;
+    for(int i = 0; i < messages.size(); i++){
+        output += messages[i] + "\n";
+    }
+    output += to_string(messages.size()) + (repair ? " problems found, repaired\n" : " problems found\n");
+    write_output(output.data(), output.size());
+}
 
-    // Go to the index and update the pointers
-    // Possible cases:
-    // Case 1: new_cluster_index is -1 so our entries fit the cluster perfectly!
-    // Case 2: new_cluster_index does exist.  Write to that cluster.
-    // Case 3: new_cluster_index does exist. However newly allocated cluster is not enough as well. Allocate another one!
-    
-    // Case 1:
-    int entry_left = entry_required;
-    int entry_registered = 0;
-    if(new_cluster_index == -1){
-        void *cluster_pointer = dblock.get_from_dblock(traverse_cluster);
-        for(int j = entry_index; j < total_fat_entries; j++){
+// DEFRAG
+#define DEFRAG_BUFFER_SIZE (8 * 1024 * 1024) // Memory budget of the copy buffer in bytes
+#define DEFRAG_MAX_CHAINS (1 << 16) // Fragmented chains moved by one defrag, the rest are left for the next run
 
-            FatFileLFN* traverse_pointer = (FatFileLFN *) cluster_pointer;
-            traverse_pointer += j;
+int remap_cluster(unordered_map<int,int> &moved, int cluster){ // Where a cluster of a moved directory is now
+    auto found = moved.find(cluster);
+    return found == moved.end() ? cluster : found->second;
+}
 
-            if(entry_left-- == 1){ // Thats the f83
-                *traverse_pointer = *((FatFileLFN *) &f83_entry);
-                break;
-            }
-            else{
-                *traverse_pointer = lfn_list[entry_registered++];
+int relocate_chain(vector<int> &chain, vector<char> &buffer, DATA_Block &dblock, FAT_Block &fblock){
+    // Copy the chain into a contiguous free run and link the run. Old chain is not freed here.
+    // Returns the first cluster of the run, -1 if there is no free run that is long enough.
+    int run_start = fblock.find_free_run(ROOT_DIRECTORY, fblock.get_cluster_limit(), chain.size());
+    if(run_start == -1){
+        return -1;
+    }
+    unsigned int cluster_size = dblock.get_cluster_size();
+    int buffer_clusters = buffer.size() / cluster_size;
+    for(int done = 0; done < chain.size();){
+        // Gather clusters into the buffer, consecutive source clusters are one run and all runs are read as one batch
+        int filled = 0;
+        vector<pair<int,int>> runs;
+        while(filled < buffer_clusters && done + filled < chain.size()){
+            int first = chain[done + filled];
+            int count = 1;
+            while(filled + count < buffer_clusters && done + filled + count < chain.size() &&
+                  chain[done + filled + count] == first + count){
+                count++;
             }
+            runs.push_back(make_pair(first, count));
+            filled += count;
+        }
+        dblock.read_runs(runs, buffer.data());
+        dblock.write_clusters(run_start + done, filled, buffer.data());
+        done += filled;
+    }
+    vector<int> run(chain.size());
+    for(int i = 0; i < chain.size(); i++){
+        run[i] = run_start + i;
+        fblock.write_to_fat(run[i], END_CLUSTER); // taken before linking, so the free count stays right
+    }
+    fblock.write_chain(run);
+    return run_start;
+}
 
-        }   
-        dblock.write_to_dblock(traverse_cluster,cluster_pointer);
-        void *tst = dblock.get_from_dblock(traverse_cluster);
-
-        for(int j = 0; j < total_fat_entries; j++){
-            FatFileLFN* traverse_pointer = (FatFileLFN *) cluster_pointer;
-            traverse_pointer += j;
-        }   
+void set_entry_cluster(int entry_cluster, int entry_index, uint32_t first_cluster, DATA_Block &dblock){
+    Cluster_Handle entry_handle = dblock.get_from_dblock(entry_cluster);
+    FatFile83 *f83_entry = (FatFile83 *) entry_handle.data() + entry_index;
+    f83_entry->firstCluster = first_cluster & 0xFFFF;
+    f83_entry->eaIndex = (first_cluster >> 16) & 0xFFFF;
+    entry_handle.mark_dirty();
+}
 
+void defrag(parsed_input *pinput, DATA_Block &dblock, FAT_Block &fblock){
+    // defrag [-n] : print how many extents the chains have, then move every fragmented chain into
+    // a contiguous run. -n only prints. The image is synced after each moved chain, so an interrupted
+    // defrag leaves at most one lost copy (check -r frees it) and running defrag again continues.
+    int report_only = pinput->arg1 && string(pinput->arg1) == "-n";
+    sync_image(dblock, fblock);
+
+    // Histogram of extent counts. It is counted while the tree is walked and only the fragmented chains
+    // are kept, at most DEFRAG_MAX_CHAINS of them, so the memory does not grow with the size of the tree.
+    const char *bucket_names[] = {"0", "1", "2", "3-4", "5-8", "9-16", "17+"};
+    unsigned int cluster_size = dblock.get_cluster_size();
+    vector<uint64_t> thread_buckets((size_t) worker_count() * 7, 0); // 7 buckets for each walking thread
+    atomic<uint64_t> kept(0);
+    atomic<uint64_t> left_chains(0);
+    vector<Walk_Entry> entries;
+    Tree_Walker walker(dblock, fblock);
+    walker.set_filter([&](Walk_Entry &entry, int id) -> int {
+        vector<pair<int,int>> runs;
+        get_cluster_runs(entry.record.first_cluster, (uint64_t) cluster_size * fblock.get_cluster_limit(), cluster_size, fblock, runs);
+        int extents = runs.size();
+        int bucket = extents <= 2 ? extents : extents <= 4 ? 3 : extents <= 8 ? 4 : extents <= 16 ? 5 : 6;
+        thread_buckets[(size_t) id * 7 + bucket]++;
+        if(report_only || extents <= 1 || entry.record.entry_cluster == -1){
+            return 0;
+        }
+        if(kept++ >= DEFRAG_MAX_CHAINS){
+            left_chains++;
+            return 0;
+        }
+        return 1;
+    });
+    walker.walk(ROOT_DIRECTORY, "/", entries);
+    uint64_t buckets[7] = {0};
+    for(size_t i = 0; i < thread_buckets.size(); i++){
+        buckets[i % 7] += thread_buckets[i];
+    }
+    string output = "extents\tentries\n";
+    for(int i = 0; i < 7; i++){
+        output += string(bucket_names[i]) + "\t" + to_string(buckets[i]) + "\n";
+    }
+    write_output(output.data(), output.size());
+    if(report_only){
+        return;
     }
-    else{// Case 2 and 3
-        while(entry_left > 0){
-            void *cluster_pointer = dblock.get_from_dblock(traverse_cluster);
-            for(int j = entry_index; j < total_fat_entries; j++){
-                FatFileLFN* traverse_pointer = (FatFileLFN *) cluster_pointer;
-                traverse_pointer += j;
 
-                if(entry_left-- == 1){ // Thats the f83
-                    *traverse_pointer = *((FatFileLFN *) &f83_entry);
-                    break;
-                }
-                else{
-                    *traverse_pointer = lfn_list[entry_registered++];
-                }
+    // Files first, then directories from the deepest one. Moving a directory changes where the entries
+    // in it are, moved holds the new place of each cluster of the moved directories.
+    sort(entries.begin(), entries.end(), [](const Walk_Entry &a, const Walk_Entry &b){
+        return a.path < b.path;
+    });
+    vector<int> order(entries.size());
+    for(int i = 0; i < entries.size(); i++){
+        order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), [&](int a, int b){
+        if(entries[a].is_folder != entries[b].is_folder){
+            return entries[a].is_folder < entries[b].is_folder;
+        }
+        return count(entries[a].path.begin(), entries[a].path.end(), '/') > count(entries[b].path.begin(), entries[b].path.end(), '/');
+    });
+
+    unordered_map<int,int> moved;
+    vector<char> buffer(max((size_t) cluster_size, (size_t) DEFRAG_BUFFER_SIZE - DEFRAG_BUFFER_SIZE % cluster_size));
+    uint64_t moved_chains = 0;
+    uint64_t moved_clusters = 0;
+    uint64_t skipped_chains = 0;
+    for(int k = 0; k < order.size(); k++){
+        Walk_Entry &entry = entries[order[k]];
+        vector<int> chain;
+        for(int cluster = entry.record.first_cluster; cluster >= ROOT_DIRECTORY && cluster < fblock.get_cluster_limit() && chain.size() < fblock.get_cluster_limit(); cluster = fblock.get_from_fat(cluster)){
+            chain.push_back(cluster);
+        }
+        int run_start = relocate_chain(chain, buffer, dblock, fblock);
+        if(run_start == -1){
+            skipped_chains++;
+            continue;
+        }
+        set_entry_cluster(remap_cluster(moved, entry.record.entry_cluster), entry.record.entry_index, run_start, dblock);
+        if(entry.is_folder){
+            for(int i = 0; i < chain.size(); i++){
+                moved[chain[i]] = run_start + i;
             }
-
-            dblock.write_to_dblock(traverse_cluster,cluster_pointer);
-
-            if(entry_left > 0){
-                if(fblock.get_from_fat(traverse_cluster) >= END_CLUSTER){  
-                    new_cluster_index =  allocate_free_cluster(dblock,fblock); // a cluster for the directory
-                    fblock.write_to_fat(traverse_cluster, new_cluster_index);
-                    fblock.write_to_fat(new_cluster_index, END_CLUSTER);
+            set_entry_cluster(run_start, 0, run_start, dblock); // .
+            // .. of the subdirectories point to this directory. The moved copy has their current clusters,
+            // the ones moved before were written to the image before this directory was copied.
+            vector<Dir_Record> records;
+            scan_directory(run_start, dblock, fblock, records);
+            for(int i = 0; i < records.size(); i++){
+                if((records[i].attributes & 0x10) && records[i].first_cluster > ROOT_DIRECTORY && records[i].first_cluster < fblock.get_cluster_limit()){
+                    set_entry_cluster(records[i].first_cluster, 1, run_start, dblock);
                 }
-                traverse_cluster = fblock.get_from_fat(traverse_cluster);
-                entry_index = 0;
-
             }
-
-        
         }
+        for(int i = 0; i < chain.size(); i++){
+            fblock.write_to_fat(chain[i], 0);
+        }
+        for(int i = 0; i < chain.size(); i++){
+            dblock.discard_cached(chain[i], 1);
+        }
+        sync_image(dblock, fblock);
+        moved_chains++;
+        moved_clusters += chain.size();
     }
 
-    // Now :
-    // 1- We set up the entries. 
-    // 2- Their attributes are correct
-    // 3- For F83, the cluster allocated to this entry is also correct
-    // All we need is to update the modification time of parent directory.
-    string parent_destination;
-    string parent_folder;
-    seperate_path_file(parent_destination, parent_folder, starting_directory);
-    //cout << "path is : " << path << endl;
-    //cout << "Started at : " << starting_directory << endl;
-    //cout << parent_destination << " | " << parent_folder << endl;
-    cd_modify(starting_directory, starting_directory, starting_cluster, dblock, fblock);
-    // cd .. -> update
+    name_index.clear(); // first clusters and entry places are changed
+    path_cache.invalidate("/");
+    if(moved_chains){
+        tree_generation++; // directories of the sessions are resolved again
+    }
+    output = "moved " + to_string(moved_chains) + " chains (" + to_string(moved_clusters) + " clusters)";
+    if(skipped_chains){
+        output += ", " + to_string(skipped_chains) + " chains have no free run";
+    }
+    if(left_chains){
+        output += ", " + to_string(left_chains) + " chains are left for the next defrag";
+    }
+    output += "\n";
+    write_output(output.data(), output.size());
 }
- 
- void touch(parsed_input *pinput, string starting_directory, int starting_cluster, DATA_Block &dblock, FAT_Block &fblock){
-    // A function of mkdir. First traverse to the path 
-    string current_directory = starting_directory;
-    int current_cluster = starting_cluster;
-
-    string temp_curr_directory = starting_directory;
-    int temp_curr_cluster = starting_cluster;
 
+// STATS
+#define LATENCY_BUCKETS 32 // Bucket i holds the commands that took less than 2^i microseconds (and more than 2^(i-1))
+
+struct Command_Stats{
+    uint64_t count = 0;
+    double wall_us = 0;
+    double cpu_us = 0; // CPU time of the process, including the worker threads
+    uint64_t syscalls = 0;
+    uint64_t cluster_reads = 0;
+    uint64_t fat_lookups = 0;
+    uint64_t histogram[LATENCY_BUCKETS] = {0};
+};
 
-    string temp2_curr_directory = starting_directory;
-    int temp2_curr_cluster = starting_cluster;
+map<string, Command_Stats> command_stats; // Keyed by the command name
+mutex stats_lock; // Sessions of the server record their commands at the same time
 
-    int total_fat_entries = dblock.get_cluster_size() / sizeof(FatFile83);
+uint64_t fat_lookup_total(){ // Lookups of the finished threads and this thread
+    return io_stats.fat_lookups + fat_lookup_counter.value;
+}
 
-    string path;
-    string folder_name;
+double cpu_time_us(){
+    struct timespec time_spec;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time_spec);
+    return time_spec.tv_sec * 1e6 + time_spec.tv_nsec / 1e3;
+}
 
-    
-    string arg1 = string(pinput->arg1);
+uint64_t latency_percentile(Command_Stats &command, double fraction){ // Upper bound of the bucket in microseconds
+    uint64_t needed = command.count * fraction;
+    uint64_t seen = 0;
+    for(int i = 0; i < LATENCY_BUCKETS; i++){
+        seen += command.histogram[i];
+        if(seen > needed){
+            return (uint64_t) 1 << i;
+        }
+    }
+    return (uint64_t) 1 << (LATENCY_BUCKETS - 1);
+}
 
-    seperate_path_file(path,folder_name,arg1);
+void record_command(const string &name, double wall_us, double cpu_us, uint64_t syscalls, uint64_t cluster_reads, uint64_t fat_lookups){
+    lock_guard<mutex> lock(stats_lock);
+    Command_Stats &command = command_stats[name];
+    command.count++;
+    command.wall_us += wall_us;
+    command.cpu_us += cpu_us;
+    command.syscalls += syscalls;
+    command.cluster_reads += cluster_reads;
+    command.fat_lookups += fat_lookups;
+    int bucket = 0;
+    while(bucket < LATENCY_BUCKETS - 1 && wall_us >= (double) ((uint64_t) 1 << bucket)){
+        bucket++;
+    }
+    command.histogram[bucket]++;
+}
 
+double hit_rate(uint64_t hits, uint64_t misses){
+    return hits + misses ? 100.0 * hits / (hits + misses) : 0;
+}
 
-    // CD into directory if possible
-    int path_exist = cd_(path,current_directory,current_cluster,dblock,fblock);
+void stats(parsed_input *pinput){
+    // stats [-r] : print the counters and the latencies of the commands, -r resets them after printing.
+    // cpu% close to 100 means the command is CPU-bound, a low value means it waits for I/O.
+    char line[256];
+    string output;
+    snprintf(line, sizeof(line), "syscalls %llu\nbytes read %llu\nbytes written %llu\nFAT lookups %llu\n"
+             "clusters read %llu\nclusters written %llu\nclusters allocated %llu\nprefetch requests %llu\n",
+             (unsigned long long) io_stats.syscalls, (unsigned long long) io_stats.bytes_read,
+             (unsigned long long) io_stats.bytes_written, (unsigned long long) fat_lookup_total(),
+             (unsigned long long) io_stats.cluster_reads, (unsigned long long) io_stats.cluster_writes,
+             (unsigned long long) io_stats.allocations, (unsigned long long) io_stats.prefetches);
+    output += line;
+    snprintf(line, sizeof(line), "cluster cache hit rate %.1f%%\ndirectory index hit rate %.1f%%\npath cache hit rate %.1f%%\n",
+             hit_rate(io_stats.cache_hits, io_stats.cache_misses), hit_rate(io_stats.index_hits, io_stats.index_misses),
+             hit_rate(io_stats.path_hits, io_stats.path_misses));
+    output += line;
+    snprintf(line, sizeof(line), "%-8s %8s %10s %10s %10s %6s %10s %10s %10s\n", "command", "count", "avg_us", "p50_us", "p99_us",
+             "cpu%", "sys/op", "reads/op", "fat/op");
+    output += line;
+    lock_guard<mutex> lock(stats_lock);
+    for(auto &entry : command_stats){
+        Command_Stats &command = entry.second;
+        snprintf(line, sizeof(line), "%-8s %8llu %10.1f %10llu %10llu %6.1f %10.1f %10.1f %10.1f\n", entry.first.c_str(),
+                 (unsigned long long) command.count, command.wall_us / command.count,
+                 (unsigned long long) latency_percentile(command, 0.5), (unsigned long long) latency_percentile(command, 0.99),
+                 command.wall_us > 0 ? 100.0 * command.cpu_us / command.wall_us : 0, (double) command.syscalls / command.count,
+                 (double) command.cluster_reads / command.count, (double) command.fat_lookups / command.count);
+        output += line;
+    }
+    write_output(output.data(), output.size());
+
+    if(pinput->arg1 && string(pinput->arg1) == "-r"){
+        command_stats.clear();
+        io_stats.syscalls = io_stats.bytes_read = io_stats.bytes_written = io_stats.fat_lookups = 0;
+        io_stats.cluster_reads = io_stats.cluster_writes = io_stats.allocations = 0;
+        io_stats.cache_hits = io_stats.cache_misses = io_stats.index_hits = io_stats.index_misses = 0;
+        io_stats.path_hits = io_stats.path_misses = io_stats.prefetches = 0;
+        fat_lookup_counter.value = 0;
+    }
+}
 
-    if(path_exist == -1){
+void write_stats_json(const char *path){ // Dump the counters and the histograms, used at exit when HW3_STATS is set
+    FILE *json = fopen(path, "w");
+    if(!json){
         return;
-    }   
-
-    int folder_exist = cd_(arg1,temp_curr_directory,temp_curr_cluster,dblock,fblock);
+    }
+    fprintf(json, "{\n  \"syscalls\": %llu,\n  \"bytes_read\": %llu,\n  \"bytes_written\": %llu,\n  \"fat_lookups\": %llu,\n"
+                  "  \"cluster_reads\": %llu,\n  \"cluster_writes\": %llu,\n  \"allocations\": %llu,\n"
+                  "  \"cache_hits\": %llu,\n  \"cache_misses\": %llu,\n  \"index_hits\": %llu,\n  \"index_misses\": %llu,\n"
+                  "  \"path_hits\": %llu,\n  \"path_misses\": %llu,\n  \"prefetches\": %llu,\n  \"commands\": {",
+            (unsigned long long) io_stats.syscalls, (unsigned long long) io_stats.bytes_read,
+            (unsigned long long) io_stats.bytes_written, (unsigned long long) fat_lookup_total(),
+            (unsigned long long) io_stats.cluster_reads, (unsigned long long) io_stats.cluster_writes,
+            (unsigned long long) io_stats.allocations, (unsigned long long) io_stats.cache_hits,
+            (unsigned long long) io_stats.cache_misses, (unsigned long long) io_stats.index_hits,
+            (unsigned long long) io_stats.index_misses, (unsigned long long) io_stats.path_hits,
+            (unsigned long long) io_stats.path_misses, (unsigned long long) io_stats.prefetches);
+    lock_guard<mutex> lock(stats_lock);
+    int first = 1;
+    for(auto &entry : command_stats){
+        Command_Stats &command = entry.second;
+        fprintf(json, "%s\n    \"%s\": {\"count\": %llu, \"wall_us\": %.1f, \"cpu_us\": %.1f, \"syscalls\": %llu, "
+                      "\"cluster_reads\": %llu, \"fat_lookups\": %llu, \"histogram_us\": [",
+                first ? "" : ",", entry.first.c_str(), (unsigned long long) command.count, command.wall_us, command.cpu_us,
+                (unsigned long long) command.syscalls, (unsigned long long) command.cluster_reads,
+                (unsigned long long) command.fat_lookups);
+        for(int i = 0; i < LATENCY_BUCKETS; i++){
+            fprintf(json, "%s%llu", i ? ", " : "", (unsigned long long) command.histogram[i]);
+        }
+        fprintf(json, "]}");
+        first = 0;
+    }
+    fprintf(json, "\n  }\n}\n");
+    fclose(json);
+}
 
-    if(folder_exist != -1){ // if folder exist
+void refresh_directory(string &current_directory, int &current_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // Sessions keep the cluster of their directory between commands. If directories were moved or freed
+    // since it was resolved, the moves it missed are applied to its path and it is resolved again from the
+    // path. If it is not a directory anymore (or its moves were dropped) the session goes back to the root.
+    // The caller holds tree_lock, so the generation and the moves do not change meanwhile.
+    uint64_t generation = tree_generation.load();
+    if(directory_generation == generation){
         return;
     }
-
-    // So now we are at the current directory and current cluster. We have to create folder
-    // Check whether there is a partial space in the cluster
-    int entry_required   = folder_name.size()/13 + 2; // if less than 13 : 1 LFN + 1 83
-    FatFileLFN* dest_pointer;
-    // Traverse the cluster and the next clusters using FAT table
-    int break_loop = 0;
-    int directory_index = -1;
-    int new_cluster_index = -1;
-    int cluster_traveled = 0;
-    int file_counter = 0;
-    int traverse_cluster;
-    int entry_index;
-    for(traverse_cluster = current_cluster; traverse_cluster < END_CLUSTER; traverse_cluster = fblock.get_from_fat(traverse_cluster)){
-        cluster_traveled++;
-        void *cluster_pointer = dblock.get_from_dblock(traverse_cluster);
-        vector<FatFileLFN*> lfn_vec;
-        // LFN entries come first.
-        int i = 0;
-        file_counter = 0;
-        for(; i < total_fat_entries; i++){    
-            // If not the root, we have to start from 2, else start from 0
-            FatFileLFN* traverse_pointer = (FatFileLFN *) cluster_pointer;
-            traverse_pointer += i;
-            int next_true_entry = (static_cast<int>(traverse_pointer->sequence_number) == 1) || (static_cast<int>(traverse_pointer->sequence_number) == 65);
-            if(next_true_entry){
-                file_counter++;
-            }
-            if(traverse_pointer->sequence_number == 0x00){
-                // After this entry, all entries are availible. 
-                dest_pointer = traverse_pointer ; // pointer to such index
-                entry_index = i; // entry index of the FAT table
-                if((total_fat_entries - i) >= entry_required){
-                    // We can insert it into this position. No more allocation needed
-                    break_loop = 1;
-                    
-                    int t_ = fblock.get_from_fat(traverse_cluster);
-                    int t_2 = t_ >= END_CLUSTER;
-                    break;
-                    
-                }
-                else{
-                        // We need to create an empty cluster.
-                        // Write . and .. to the start 
-                        //  after we have reached the end of the cluster
-                        // we should move into the next one and start 
-                        // reading from first entry.
-                        new_cluster_index =  allocate_free_cluster(dblock,fblock); // a cluster for the directory
-                        fblock.write_to_fat(traverse_cluster, new_cluster_index);
-                        fblock.write_to_fat(new_cluster_index, END_CLUSTER);
-
-                        break_loop = 1;
-                        break;
-                }
-                free(cluster_pointer);
-                return ;
-            }
-            else if(traverse_pointer->sequence_number == 0xE5){
-                // Skip the erased content
-                continue;
-            }
-            
-            if(break_loop){
-                break;
-            }
-        }
-        if(break_loop){
-            break;
+    string destination = current_directory;
+    for(int i = 0; i < directory_moves.size(); i++){
+        if(directory_moves[i].generation > directory_generation){
+            destination = moved_directory_path(destination, directory_moves[i]);
         }
     }
-    // new_cluster_index is the index of the new block (empty cluster)
-    // dest_pointer points to the first empty directory entry
-    
-    // Creat the LFN and 8.3 entries
-    // Fill the checksum, creation and modification date etc..
-    vector<FatFileLFN> lfn_list(entry_required-1);
-    FatFile83 f83_entry = create_entry(file_counter + 1,0,0);
-    
-    create_lfn_list(lfn_list,folder_name);  // fill out entries in lfn_list and f83_entry
-
-    // Go to the index and update the pointers
-    // Possible cases:
-    // Case 1: new_cluster_index is -1 so our entries fit the cluster perfectly!
-    // Case 2: new_cluster_index does exist.  Write to that cluster.
-    // Case 3: new_cluster_index does exist. However newly allocated cluster is not enough as well. Allocate another one!
-    
-    // Case 1:
-    int entry_left = entry_required;
-    int entry_registered = 0;
-    if(new_cluster_index == -1){
-        void *cluster_pointer = dblock.get_from_dblock(traverse_cluster);
-        for(int j = entry_index; j < total_fat_entries; j++){
-
-            FatFileLFN* traverse_pointer = (FatFileLFN *) cluster_pointer;
-            traverse_pointer += j;
-
-            if(entry_left-- == 1){ // Thats the f83
-                *traverse_pointer = *((FatFileLFN *) &f83_entry);
-                break;
-            }
-            else{
-                *traverse_pointer = lfn_list[entry_registered++];
-            }
-
-        }   
-        dblock.write_to_dblock(traverse_cluster,cluster_pointer);
-        void *tst = dblock.get_from_dblock(traverse_cluster);
-
-        for(int j = 0; j < total_fat_entries; j++){
-            FatFileLFN* traverse_pointer = (FatFileLFN *) cluster_pointer;
-            traverse_pointer += j;
-        }   
-
+    directory_generation = generation;
+    string directory = "/";
+    int cluster = ROOT_DIRECTORY;
+    if(cd_(destination, directory, cluster, dblock, fblock) == -1 || !is_directory_path(directory, dblock, fblock)){
+        directory = "/";
+        cluster = ROOT_DIRECTORY;
     }
-    else{// Case 2 and 3
-        while(entry_left > 0){
-            void *cluster_pointer = dblock.get_from_dblock(traverse_cluster);
-            for(int j = entry_index; j < total_fat_entries; j++){
-                FatFileLFN* traverse_pointer = (FatFileLFN *) cluster_pointer;
-                traverse_pointer += j;
-
-                if(entry_left-- == 1){ // Thats the f83
-                    *traverse_pointer = *((FatFileLFN *) &f83_entry);
-                    break;
-                }
-                else{
-                    *traverse_pointer = lfn_list[entry_registered++];
-                }
-            }
+    current_directory = directory;
+    current_cluster = cluster;
+}
 
-            dblock.write_to_dblock(traverse_cluster,cluster_pointer);
+int run_command(string &current_command, string &current_directory, int &current_cluster, DATA_Block &dblock, FAT_Block &fblock){
+    // Parse and run one command line. Returns 1 if the command is quit. Blank lines are skipped.
+    if(current_command.find_first_not_of(" \t\r") == string::npos){ // the parser expects a command
+        return 0;
+    }
+    parsed_input input;
+    parsed_input *pinput = &input;
+    int QUIT_RECEIVED = 0;
+    thread_local vector<char> line_buffer; // parse changes the line, so it gets a copy. The copy is reused by the next commands.
+    line_buffer.assign(current_command.begin(), current_command.end());
+    line_buffer.push_back('\0');
+    parse(pinput,line_buffer.data());
+
+    // Counters before the command, the difference is recorded for the command
+    auto start_time = chrono::steady_clock::now();
+    double start_cpu = cpu_time_us();
+    uint64_t start_syscalls = io_stats.syscalls;
+    uint64_t start_reads = io_stats.cluster_reads;
+    uint64_t start_lookups = fat_lookup_total();
+
+    int command_type = pinput->type;
+    // Commands that walk or rewrite the whole tree, move entries between directories, or write the caches back, run alone.
+    // The others run together and lock the directories they read or change.
+    int whole_tree = command_type == QUIT || command_type == SYNC || command_type == FIND || command_type == DU ||
+                     command_type == CHECK || command_type == DEFRAG || command_type == IMPORT || command_type == MV ||
+                     command_type == COMPACT || command_type == RM || command_type == RMDIR;
+    shared_lock<shared_mutex> shared_tree(tree_lock, defer_lock);
+    unique_lock<shared_mutex> exclusive_tree(tree_lock, defer_lock);
+    if(whole_tree){
+        exclusive_tree.lock();
+    }
+    else{
+        shared_tree.lock();
+    }
+    refresh_directory(current_directory, current_cluster, dblock, fblock);
 
-            if(entry_left > 0){
-                if(fblock.get_from_fat(traverse_cluster) >= END_CLUSTER){  
-                    new_cluster_index =  allocate_free_cluster(dblock,fblock); // a cluster for the directory
-                    fblock.write_to_fat(traverse_cluster, new_cluster_index);
-                    fblock.write_to_fat(new_cluster_index, END_CLUSTER);
-                }
-                traverse_cluster = fblock.get_from_fat(traverse_cluster);
-                entry_index = 0;
+    if(command_type == QUIT){
+        QUIT_RECEIVED = 1;
+        sync_image(dblock,fblock);
+    }
+    else if(command_type == SYNC){
+        sync_image(dblock,fblock);
+    }
+    else if(command_type == CD){
+        cd(pinput,current_directory,current_cluster,dblock,fblock);
+    }
+    else if(command_type == LS){
+        ls(pinput,current_directory,current_cluster,dblock,fblock);
+    }
+    else if(command_type == CAT){
+        cat(pinput,current_directory,current_cluster,dblock,fblock);
+    }
+    else if(command_type == MKDIR){
+        mkdir(pinput,current_directory,current_cluster,dblock,fblock);
+    }
+    else if(command_type == TOUCH){
+        touch(pinput,current_directory,current_cluster,dblock,fblock);
+    }
+    else if(command_type == CPOUT){
+        cpout(pinput,current_directory,current_cluster,dblock,fblock);
+    }
+    else if(command_type == CPIN){
+        cpin(pinput,current_directory,current_cluster,dblock,fblock);
+    }
+    else if(command_type == MV){
+        mv(pinput,current_directory,current_cluster,dblock,fblock);
+    }
+    else if(command_type == IMPORT){
+        import_tree(pinput,current_directory,current_cluster,dblock,fblock);
+    }
+    else if(command_type == FIND){
+        find(pinput,current_directory,current_cluster,dblock,fblock);
+    }
+    else if(command_type == DU){
+        du(pinput,current_directory,current_cluster,dblock,fblock);
+    }
+    else if(command_type == CHECK){
+        check(pinput,dblock,fblock);
+    }
+    else if(command_type == DEFRAG){
+        defrag(pinput,dblock,fblock);
+    }
+    else if(command_type == STATS){
+        stats(pinput);
+    }
+    else if(command_type == COMPACT){
+        compact(pinput,current_directory,current_cluster,dblock,fblock);
+    }
+    else if(command_type == RM){
+        rm(pinput,current_directory,current_cluster,dblock,fblock);
+    }
+    else if(command_type == RMDIR){
+        rmdir(pinput,current_directory,current_cluster,dblock,fblock);
+    }
 
-            }
+    refresh_directory(current_directory, current_cluster, dblock, fblock); // the command may have moved it
 
+    if(command_type == MKDIR || command_type == TOUCH || command_type == CPIN || command_type == MV || command_type == COMPACT ||
+       command_type == RM || command_type == RMDIR){
+        journal.add_operation();
+    }
+    if(journal.enabled() && journal.needs_commit(dblock)){
+        // Commit the group once the other sessions are done with their commands
+        if(!whole_tree){
+            shared_tree.unlock();
+            exclusive_tree.lock();
         }
+        if(journal.needs_commit(dblock)){ // another session may have committed it already
+            sync_image(dblock,fblock);
+        }
+    }
+
+    if(!output_sink.buffered){
+        output_stream().flush(); // output is part of the command's time
     }
-    // Now :
-    // 1- We set up the entries. 
-    // 2- Their attributes are correct
-    // 3- For F83, the cluster allocated to this entry is also correct
-    // All we need is to update the modification time of parent directory.
-    cd_modify(starting_directory, starting_directory, starting_cluster, dblock, fblock);
-    // cd .. -> update
+    record_command(current_command.substr(0, current_command.find(' ')),
+                   chrono::duration<double, micro>(chrono::steady_clock::now() - start_time).count(),
+                   cpu_time_us() - start_cpu, io_stats.syscalls - start_syscalls,
+                   io_stats.cluster_reads - start_reads, fat_lookup_total() - start_lookups);
+
+    clean_input(pinput);
+    return QUIT_RECEIVED;
 }
 
 void run_program(int &EXIT_STATUS_, DATA_Block &dblock, FAT_Block &fblock){
@@ -1759,8 +4728,6 @@ void run_program(int &EXIT_STATUS_, DATA_Block &dblock, FAT_Block &fblock){
     // YETER ARTIK ÖDEV YAPMAK İSTEYMİORUM
     int current_cluster = ROOT_DIRECTORY;
     string current_directory = "/"; // at the start, we are in root
-    parsed_input* pinput = new parsed_input();
-    int command_length;
     int QUIT_RECEIVED = 0;
 
 
@@ -1768,39 +4735,209 @@ void run_program(int &EXIT_STATUS_, DATA_Block &dblock, FAT_Block &fblock){
         string current_command;
         std::cout << current_directory << ">";
 
-        getline(cin,current_command);
-        command_length = current_command.size(); 
-        char *string_c_str = new char[command_length + 1]; // possible memory leak, dont forget to delete
-        string_to_c_str(current_command,string_c_str); 
-        parse(pinput,string_c_str);
-        int command_type = pinput->type;
-        if(command_type == QUIT){
-            QUIT_RECEIVED = 1;
-            EXIT_STATUS_ = QUIT;
+        if(!getline(cin,current_command)){
+            current_command = "quit"; // end of the input
+        }
+        QUIT_RECEIVED = run_command(current_command,current_directory,current_cluster,dblock,fblock);
+    } 
+    EXIT_STATUS_ = QUIT;
+}
+
+#define BATCH_OUTPUT_SIZE (1024 * 1024) // Output of batch mode is written in chunks of this size
+
+void run_batch(istream &commands, DATA_Block &dblock, FAT_Block &fblock){
+    // Run the commands of a script without prompts. Output is collected in a large buffer that is
+    // written when it is full and at the end. End of the script is the same as quit.
+    Fd_Streambuf output_buffer(STDOUT_FILENO, BATCH_OUTPUT_SIZE);
+    ostream batch_stream(&output_buffer);
+    output_sink.stream = &batch_stream;
+    output_sink.buffered = 1;
+
+    int current_cluster = ROOT_DIRECTORY;
+    string current_directory = "/";
+    string current_command; // reused, so its memory is not allocated for every line
+    int QUIT_RECEIVED = 0;
+    while(!QUIT_RECEIVED){
+        if(!getline(commands, current_command)){
+            current_command = "quit";
+        }
+        QUIT_RECEIVED = run_command(current_command, current_directory, current_cluster, dblock, fblock);
+    }
+    batch_stream.flush();
+    output_sink = Output_Sink();
+}
+
+// SERVER
+
+#define SERVER_BACKLOG 64
+#define SESSION_READ_SIZE 4096
+
+volatile sig_atomic_t server_stopping = 0;
+
+void stop_server(int){
+    server_stopping = 1;
+}
+
+int read_line(int fd, string &pending, string &line){
+    // Take the next line from pending, reading from fd until a whole line is there. Returns 0 at the end of input.
+    char chunk[SESSION_READ_SIZE];
+    while(1){
+        size_t end = pending.find('\n');
+        if(end != string::npos){
+            line = pending.substr(0, end);
+            pending.erase(0, end + 1);
+            if(!line.empty() && line.back() == '\r'){
+                line.pop_back();
+            }
+            return 1;
+        }
+        ssize_t r = read(fd, chunk, sizeof(chunk));
+        if(r < 0 && errno == EINTR){
+            continue;
         }
-        else if(command_type == CD){
-            cd(pinput,current_directory,current_cluster,dblock,fblock);
+        if(r <= 0){
+            if(pending.empty()){
+                return 0;
+            }
+            line = pending; // last line without a newline
+            pending.clear();
+            return 1;
         }
-        else if(command_type == LS){
-            ls(pinput,current_directory,current_cluster,dblock,fblock);
+        pending.append(chunk, r);
+    }
+}
+
+struct Server_State{
+    mutex lock;
+    condition_variable session_ended;
+    map<int, int> clients; // Socket of each running session, keyed by the session id
+    vector<int> finished; // Sessions that ended, their threads are joined by the accepting thread
+};
+
+void run_session(int session_id, int client_fd, Server_State &server, DATA_Block &dblock, FAT_Block &fblock){
+    // One client of the server. It is the loop of run_program with its own current directory,
+    // commands are read from the socket and their output is written to it. quit writes the image
+    // back and ends only this session.
+    Fd_Streambuf socket_buffer(client_fd);
+    ostream socket_stream(&socket_buffer);
+    output_sink.fd = client_fd;
+    output_sink.stream = &socket_stream;
+
+    string current_directory = "/";
+    int current_cluster = ROOT_DIRECTORY;
+    string pending;
+    string current_command;
+    int QUIT_RECEIVED = 0;
+    while(!QUIT_RECEIVED){
+        socket_stream << current_directory << ">";
+        socket_stream.flush();
+        if(!read_line(client_fd, pending, current_command)){
+            break;
         }
-        else if(command_type == CAT){
-            cat(pinput,current_directory,current_cluster,dblock,fblock);
+        QUIT_RECEIVED = run_command(current_command, current_directory, current_cluster, dblock, fblock);
+    }
+    socket_stream.flush();
+    output_sink = Output_Sink();
+
+    lock_guard<mutex> lock(server.lock);
+    server.clients.erase(session_id);
+    server.finished.push_back(session_id);
+    close(client_fd);
+    server.session_ended.notify_all();
+}
+
+void join_finished(Server_State &server, map<int, thread> &sessions){
+    vector<int> finished;
+    {
+        lock_guard<mutex> lock(server.lock);
+        finished.swap(server.finished);
+    }
+    for(int i = 0; i < finished.size(); i++){
+        sessions[finished[i]].join();
+        sessions.erase(finished[i]);
+    }
+}
+
+int run_server(const char *socket_path, DATA_Block &dblock, FAT_Block &fblock){
+    // Serve the image on a Unix domain socket until SIGINT or SIGTERM. The image is opened once and
+    // every connection is a session on its own thread, so many clients query it at the same time.
+    // Returns -1 if the socket can not be set up.
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(address.sun_path)){
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+    int server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(server_fd < 0){
+        return -1;
+    }
+    unlink(socket_path); // left from a previous run
+    if(bind(server_fd, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(server_fd, SERVER_BACKLOG) == -1){
+        close(server_fd);
+        return -1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_server;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN); // a client that leaves early gives EPIPE instead of ending the server
+
+    // The stop signals are blocked except while waiting in ppoll, so a signal can not be missed between
+    // the check and the wait. Sessions inherit the blocked mask.
+    sigset_t stop_signals, wait_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+
+    Server_State server;
+    map<int, thread> sessions;
+    int next_session = 0;
+    while(!server_stopping){
+        struct pollfd poll_fd;
+        poll_fd.fd = server_fd;
+        poll_fd.events = POLLIN;
+        int ready = ppoll(&poll_fd, 1, NULL, &wait_mask);
+        join_finished(server, sessions);
+        if(ready <= 0){
+            continue;
         }
-        else if(command_type == MKDIR){
-            mkdir(pinput,current_directory,current_cluster,dblock,fblock);
+        int client_fd = accept(server_fd, NULL, NULL);
+        if(client_fd < 0){
+            continue;
         }
-        else if(command_type == TOUCH){
-            touch(pinput,current_directory,current_cluster,dblock,fblock);
+        int session_id = next_session++;
+        {
+            lock_guard<mutex> lock(server.lock);
+            server.clients[session_id] = client_fd;
         }
+        sessions[session_id] = thread(run_session, session_id, client_fd, ref(server), ref(dblock), ref(fblock));
+    }
 
-        clean_input(pinput);
-        delete[] string_c_str; // free allocated memory
-    } 
+    {
+        // Reads of the sessions return the end of input, running commands are finished
+        unique_lock<mutex> lock(server.lock);
+        for(auto &client : server.clients){
+            shutdown(client.second, SHUT_RDWR);
+        }
+        server.session_ended.wait(lock, [&server]{ return server.clients.empty(); });
+    }
+    join_finished(server, sessions);
+    pthread_sigmask(SIG_SETMASK, &wait_mask, NULL);
+    close(server_fd);
+    unlink(socket_path);
+    sync_image(dblock, fblock);
+    return 0;
 }
 
 
 
+#ifndef HW3_NO_MAIN // mkimage includes this file for the FAT32 structures and entry helpers
 int main(int argc, char *argv[])
 {
     // Read image file
@@ -1808,16 +4945,103 @@ int main(int argc, char *argv[])
 	int fd;
     string path_to_image = argv[1];
 	fd = open(path_to_image.c_str(), O_RDWR);
+    string journal_path = path_to_image + ".journal";
+    int replayed = replay_journal(fd, journal_path); // changes of a commit that did not reach the image
+    if(replayed > 0){
+        cerr << "hw3: replayed " << replayed << " writes from " << journal_path << endl;
+    }
 	read(fd, &bpb, BPBS);
 
-    FAT_Block fat_b = FAT_Block(bpb,fd);
-    DATA_Block data_b = DATA_Block(bpb,fd);
+    // Options after the image path
+    // -m : map the whole image into the memory instead of reading clusters with syscalls
+    // -c <MB> : memory budget of the cluster cache
+    // -u : submit batches of reads and writes through io_uring, preadv/pwritev are used if the kernel does not support it
+    // -s <socket> : serve the image to many clients on a Unix domain socket instead of reading stdin
+    // -j : log the metadata changes to <image>.journal and commit them in groups, -m is ignored
+    // -b <script> : run the commands of script without prompts, same as giving them on stdin that is not a terminal
+    int use_mmap = 0;
+    const char *script_path = NULL;
+    int use_journal = 0;
+    const char *socket_path = NULL;
+    size_t cache_budget = DEFAULT_CACHE_BUDGET;
+    for(int i = 2; i < argc; i++){
+        if(string(argv[i]) == "-m"){
+            use_mmap = 1;
+        }
+        else if(string(argv[i]) == "-u"){
+            uring_enabled = 1;
+        }
+        else if(string(argv[i]) == "-j"){
+            use_journal = 1;
+        }
+        else if(string(argv[i]) == "-c" && i + 1 < argc){
+            cache_budget = (size_t) atol(argv[++i]) * 1024 * 1024;
+        }
+        else if(string(argv[i]) == "-s" && i + 1 < argc){
+            socket_path = argv[++i];
+        }
+        else if(string(argv[i]) == "-b" && i + 1 < argc){
+            script_path = argv[++i];
+        }
+    }
+
+    char *image_map = NULL;
+    size_t image_size = 0;
+    if(use_mmap && !use_journal){ // writes through the mapping can not be held back for the journal
+        struct stat image_stat;
+        fstat(fd, &image_stat);
+        image_size = image_stat.st_size;
+        void *mapping = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(mapping != MAP_FAILED){
+            image_map = (char *) mapping;
+        } // else, fall back to lseek + read/write
+    }
 
-    string current_directory = "/";
-    int current_cluster = 2;
+    FAT_Block fat_b = FAT_Block(bpb,fd,image_map);
+    DATA_Block data_b = DATA_Block(bpb,fd,image_map,cache_budget);
+    if(use_journal){
+        if(journal.open_journal(journal_path, fd) == -1){
+            cerr << "hw3: can not open " << journal_path << ", running without the journal" << endl;
+        }
+        else{
+            data_b.set_journaled(1);
+            fat_b.set_deferred_frees(1);
+        }
+    }
 
     int EXIT_STATUS;
-    run_program(EXIT_STATUS, data_b, fat_b);
-	parsed_input parsed_command;
+    if(socket_path){
+        if(run_server(socket_path, data_b, fat_b) == -1){
+            cerr << "hw3: can not listen on " << socket_path << endl;
+        }
+    }
+    else if(script_path){
+        ifstream script(script_path);
+        if(!script){
+            cerr << "hw3: can not open " << script_path << endl;
+        }
+        else{
+            run_batch(script, data_b, fat_b);
+        }
+    }
+    else if(!isatty(STDIN_FILENO)){
+        ios::sync_with_stdio(false); // cin reads large blocks
+        cin.tie(NULL); // and does not flush cout before each line
+        run_batch(cin, data_b, fat_b);
+    }
+    else{
+        run_program(EXIT_STATUS, data_b, fat_b);
+    }
+    const char *stats_path = getenv("HW3_STATS"); // Path of the JSON dump of the stats
+    if(stats_path){
+        write_stats_json(stats_path);
+    }
+
+    if(image_map){ // Writes went through the mapping, make sure they reach to the image
+        msync(image_map, image_size, MS_SYNC);
+        munmap(image_map, image_size);
+    }
+    close(fd);
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,338 @@
+// Synthetic FAT32 image generator for benchmarking hw3.
+// Builds the directory tree in memory, allocates the chains with the FAT_Block of hw3 and
+// writes only the directory clusters and the FAT. File clusters are left as the zeros of the
+// sparse image unless -w is given, so multi-GB images are created in seconds.
+// Same options and seed always give the same image. -s 0 sizes the image to fit the tree.
+#define HW3_NO_MAIN
+#include "hw3.cpp"
+#include <random>
+
+#define MKIMAGE_RESERVED_SECTORS 32
+#define MKIMAGE_FAT_COUNT 2
+#define MKIMAGE_BACKUP_BOOT_SECTOR 6
+#define MKIMAGE_DATE ((40 << 9) | (1 << 5) | 1) // Every entry gets the same date and time
+#define MKIMAGE_TIME 0
+#define MKIMAGE_MAX_GAP 8 // Maximum number of clusters skipped at a fragmentation point
+
+struct Image_Options{
+    uint64_t size_mb = 256; // 0 picks a size that fits the tree
+    int sectors_per_cluster = 8;
+    int fanout = 4; // Subdirectories in each directory
+    int depth = 3; // Levels of subdirectories below the root
+    int files_per_directory = 16;
+    int min_name = 8; // Name length range
+    int max_name = 24;
+    uint64_t mean_file_size = 16 * 1024;
+    string distribution = "exp"; // fixed, uniform or exp
+    int fragmentation = 0; // Percent of the clusters that start a new extent
+    uint64_t seed = 1;
+    int write_data = 0; // Fill the file clusters with a pattern
+};
+
+class Image_Allocator{
+    /*
+        Hands out clusters in increasing order. With fragmentation percent probability a few clusters
+        are skipped and kept as holes, and with the same probability the next cluster is taken from
+        the holes. So the chains of different files are interleaved.
+    */
+    FAT_Block &fblock;
+    mt19937_64 &rng;
+    int fragmentation;
+    unsigned int cursor = ROOT_DIRECTORY + 1;
+    deque<int> holes;
+
+    int next(){
+        if(!holes.empty() && (cursor >= fblock.get_cluster_limit() || (int) (rng() % 100) < fragmentation)){
+            int cluster = holes.front();
+            holes.pop_front();
+            return cluster;
+        }
+        if((int) (rng() % 100) < fragmentation){
+            unsigned int gap = 1 + rng() % MKIMAGE_MAX_GAP;
+            for(unsigned int i = 0; i < gap && cursor < fblock.get_cluster_limit(); i++){
+                holes.push_back(cursor++);
+            }
+        }
+        if(cursor >= fblock.get_cluster_limit()){
+            if(holes.empty()){
+                return -1;
+            }
+            int cluster = holes.front();
+            holes.pop_front();
+            return cluster;
+        }
+        return cursor++;
+    }
+
+    public:
+        Image_Allocator(FAT_Block &fblock_, mt19937_64 &rng_, int fragmentation_) : fblock(fblock_), rng(rng_), fragmentation(fragmentation_){}
+
+        int allocate(unsigned int count, vector<int> &clusters){ // Append count clusters and link the chain
+            for(unsigned int i = 0; i < count; i++){
+                int cluster = next();
+                if(cluster == -1){
+                    return -1;
+                }
+                clusters.push_back(cluster);
+            }
+            fblock.write_chain(clusters);
+            return 0;
+        }
+};
+
+string random_name(mt19937_64 &rng, Image_Options &options, int index){
+    // Random letters followed by the index, so names in a directory are unique
+    string suffix = to_string(index);
+    int length = options.min_name + rng() % (options.max_name - options.min_name + 1);
+    string name;
+    for(int i = suffix.size(); i < length; i++){
+        name += (char) ('a' + rng() % 26);
+    }
+    return name + suffix;
+}
+
+uint64_t random_size(mt19937_64 &rng, Image_Options &options){
+    double size = options.mean_file_size;
+    if(options.distribution == "uniform"){
+        size = uniform_real_distribution<double>(0, 2.0 * options.mean_file_size)(rng);
+    }
+    else if(options.distribution == "exp" && options.mean_file_size > 0){
+        size = exponential_distribution<double>(1.0 / options.mean_file_size)(rng);
+    }
+    return size > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint64_t) size;
+}
+
+void generate_tree(Import_Node &node, int level, mt19937_64 &rng, Image_Options &options){
+    int index = 0;
+    for(int i = 0; i < options.files_per_directory; i++){
+        Import_Node child;
+        child.name = random_name(rng, options, index++);
+        child.is_folder = 0;
+        child.size = random_size(rng, options);
+        node.children.push_back(child);
+    }
+    if(level >= options.depth){
+        return;
+    }
+    for(int i = 0; i < options.fanout; i++){
+        Import_Node child;
+        child.name = random_name(rng, options, index++);
+        child.is_folder = 1;
+        child.size = 0;
+        generate_tree(child, level + 1, rng, options);
+        node.children.push_back(child);
+    }
+}
+
+int allocate_generated(Import_Node &node, unsigned int cluster_size, Image_Allocator &allocator){
+    // Same cluster counts as import, directories first so they are close to their parent
+    uint64_t bytes = node.is_folder ? (uint64_t) directory_entry_count(node) * sizeof(FatFile83) : node.size;
+    unsigned int count = (bytes + cluster_size - 1) / cluster_size;
+    if(node.clusters.size() == 1){ // root already has its first cluster
+        count = count > 1 ? count - 1 : 0;
+    }
+    if(count > 0 && allocator.allocate(count, node.clusters) == -1){
+        return -1;
+    }
+    for(int i = 0; i < node.children.size(); i++){
+        if(allocate_generated(node.children[i], cluster_size, allocator) == -1){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void write_generated(Import_Node &node, int parent_cluster, Cluster_Writer &writer, unsigned int cluster_size, Image_Options &options, vector<char> &pattern, uint64_t &directories, uint64_t &files){
+    if(!node.is_folder){
+        files++;
+        for(int k = 0; options.write_data && k < node.clusters.size(); k++){
+            writer.add(node.clusters[k], pattern.data() + (size_t) (node.clusters[k] % 64) * cluster_size);
+        }
+        return;
+    }
+    directories++;
+    vector<char> buffer;
+    pack_directory(node, parent_cluster, cluster_size, buffer);
+    FatFile83 *entries = (FatFile83 *) buffer.data();
+    for(int i = 0; i < buffer.size() / sizeof(FatFile83); i++){
+        if(entries[i].filename[0] != 0x00 && entries[i].attributes != 0x0F){
+            entries[i].creationDate = entries[i].modifiedDate = MKIMAGE_DATE;
+            entries[i].creationTime = entries[i].modifiedTime = MKIMAGE_TIME;
+        }
+    }
+    for(int k = 0; k < node.clusters.size(); k++){
+        writer.add(node.clusters[k], buffer.data() + (size_t) k * cluster_size);
+    }
+    for(int i = 0; i < node.children.size(); i++){
+        write_generated(node.children[i], node.clusters[0], writer, cluster_size, options, pattern, directories, files);
+    }
+}
+
+int format_image(int fd, Image_Options &options, BPB_struct &bpb){
+    // Write an empty FAT32 file system: boot sector and its backup, FSInfo and the FAT with the root cluster
+    uint64_t total_sectors = options.size_mb * 1024 * 1024 / BPS;
+    if(total_sectors > 0xFFFFFFFFu || ftruncate(fd, 0) == -1 || ftruncate(fd, total_sectors * BPS) == -1){
+        return -1;
+    }
+    uint32_t fat_size = 1;
+    for(int i = 0; i < 4; i++){ // FAT size and the cluster count depend on each other
+        uint64_t data_sectors = total_sectors - MKIMAGE_RESERVED_SECTORS - (uint64_t) MKIMAGE_FAT_COUNT * fat_size;
+        uint64_t clusters = data_sectors / options.sectors_per_cluster;
+        fat_size = ((clusters + 2) * INTS + BPS - 1) / BPS;
+    }
+
+    memset(&bpb, 0, BPBS);
+    memcpy(bpb.BS_JumpBoot, "\xEB\x58\x90", 3);
+    memcpy(bpb.BS_OEMName, "MKIMAGE ", 8);
+    bpb.BytesPerSector = BPS;
+    bpb.SectorsPerCluster = options.sectors_per_cluster;
+    bpb.ReservedSectorCount = MKIMAGE_RESERVED_SECTORS;
+    bpb.NumFATs = MKIMAGE_FAT_COUNT;
+    bpb.Media = 0xF8;
+    bpb.SectorsPerTrack = 63;
+    bpb.NumberOfHeads = 255;
+    bpb.TotalSectors32 = total_sectors;
+    bpb.extended.FATSize = fat_size;
+    bpb.extended.RootCluster = ROOT_DIRECTORY;
+    bpb.extended.FSInfo = 1;
+    bpb.extended.BkBootSec = MKIMAGE_BACKUP_BOOT_SECTOR;
+    bpb.extended.BS_DriveNumber = 0x80;
+    bpb.extended.BS_BootSig = 0x29;
+    bpb.extended.BS_VolumeID = options.seed;
+    memcpy(bpb.extended.BS_VolumeLabel, "NO NAME    ", 11);
+    memcpy(bpb.extended.BS_FileSystemType, "FAT32   ", 8);
+
+    char sector[BPS] = {0};
+    memcpy(sector, &bpb, BPBS);
+    sector[510] = 0x55;
+    sector[511] = (char) 0xAA;
+    pwrite(fd, sector, BPS, 0);
+    pwrite(fd, sector, BPS, (uint64_t) MKIMAGE_BACKUP_BOOT_SECTOR * BPS);
+
+    uint32_t value;
+    memset(sector, 0, BPS);
+    value = FSINFO_LEAD_SIG;
+    memcpy(sector, &value, 4);
+    value = FSINFO_STRUCT_SIG;
+    memcpy(sector + 484, &value, 4);
+    value = 0xFFFFFFFF; // unknown, filled by FAT_Block
+    memcpy(sector + FSINFO_FREE_COUNT, &value, 4);
+    memcpy(sector + FSINFO_NEXT_FREE, &value, 4);
+    value = 0xAA550000;
+    memcpy(sector + 508, &value, 4);
+    pwrite(fd, sector, BPS, (uint64_t) bpb.extended.FSInfo * BPS);
+
+    uint32_t first_entries[3] = {0x0FFFFFF8, 0x0FFFFFFF, 0x0FFFFFFF}; // media, reserved and the root cluster
+    pwrite(fd, first_entries, sizeof(first_entries), (uint64_t) MKIMAGE_RESERVED_SECTORS * BPS);
+    return 0;
+}
+
+uint64_t count_clusters(Import_Node &node, unsigned int cluster_size){ // Clusters needed by the node and everything below it
+    uint64_t bytes = node.is_folder ? (uint64_t) directory_entry_count(node) * sizeof(FatFile83) : node.size;
+    uint64_t count = (bytes + cluster_size - 1) / cluster_size;
+    for(int i = 0; i < node.children.size(); i++){
+        count += count_clusters(node.children[i], cluster_size);
+    }
+    return count;
+}
+
+int build_image(const string &path_to_image, Image_Options &options, Import_Node &root, uint64_t &directories, uint64_t &files){
+    // Generate the tree into root and write the image. Returns -1 if the image cannot be created or is too small.
+    mt19937_64 rng(options.seed);
+    root = Import_Node();
+    root.name = "/";
+    root.is_folder = 1;
+    root.size = 0;
+    root.clusters.push_back(ROOT_DIRECTORY);
+    generate_tree(root, 0, rng, options);
+    if(options.size_mb == 0){ // room for the tree and a quarter more
+        uint64_t cluster_size = (uint64_t) options.sectors_per_cluster * BPS;
+        options.size_mb = count_clusters(root, cluster_size) * cluster_size * 5 / 4 / (1024 * 1024) + 16;
+    }
+
+    int fd = open(path_to_image.c_str(), O_RDWR | O_CREAT, 0644);
+    BPB_struct bpb;
+    if(fd == -1 || format_image(fd, options, bpb) == -1){
+        cerr << "mkimage: cannot create " << path_to_image << endl;
+        if(fd != -1){
+            close(fd);
+        }
+        return -1;
+    }
+
+    FAT_Block fblock(bpb, fd);
+    DATA_Block dblock(bpb, fd);
+    unsigned int cluster_size = dblock.get_cluster_size();
+    Image_Allocator allocator(fblock, rng, options.fragmentation);
+    if(allocate_generated(root, cluster_size, allocator) == -1){
+        cerr << "mkimage: image is too small for the tree" << endl;
+        close(fd);
+        return -1;
+    }
+
+    vector<char> pattern((size_t) 64 * cluster_size); // 64 clusters of bytes from the seed
+    for(size_t i = 0; i < pattern.size(); i++){
+        pattern[i] = (char) rng();
+    }
+    directories = 0;
+    files = 0;
+    Cluster_Writer writer(dblock);
+    write_generated(root, ROOT_DIRECTORY, writer, cluster_size, options, pattern, directories, files);
+    writer.finish();
+
+    fblock.mark_all_dirty(); // both FAT copies are written completely
+    fblock.flush();
+    close(fd);
+    return 0;
+}
+
+#ifndef MKIMAGE_NO_MAIN // bench includes this file for build_image
+void usage(){
+    cerr << "usage: mkimage <image> [-s size_MB] [-c sectors_per_cluster] [-f fanout] [-d depth]" << endl
+         << "               [-F files_per_directory] [-n min_name] [-N max_name] [-z mean_file_size]" << endl
+         << "               [-D fixed|uniform|exp] [-g fragmentation_percent] [-r seed] [-w]" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2){
+        usage();
+        return 1;
+    }
+    string path_to_image = argv[1];
+    Image_Options options;
+    int option;
+    optind = 2;
+    while((option = getopt(argc, argv, "s:c:f:d:F:n:N:z:D:g:r:w")) != -1){
+        switch(option){
+            case 's': options.size_mb = atoll(optarg); break;
+            case 'c': options.sectors_per_cluster = atoi(optarg); break;
+            case 'f': options.fanout = atoi(optarg); break;
+            case 'd': options.depth = atoi(optarg); break;
+            case 'F': options.files_per_directory = atoi(optarg); break;
+            case 'n': options.min_name = atoi(optarg); break;
+            case 'N': options.max_name = atoi(optarg); break;
+            case 'z': options.mean_file_size = atoll(optarg); break;
+            case 'D': options.distribution = optarg; break;
+            case 'g': options.fragmentation = atoi(optarg); break;
+            case 'r': options.seed = atoll(optarg); break;
+            case 'w': options.write_data = 1; break;
+            default: usage(); return 1;
+        }
+    }
+    int spc = options.sectors_per_cluster;
+    if(spc < 1 || spc > 128 || (spc & (spc - 1)) || options.min_name < 1 || options.max_name < options.min_name){
+        usage();
+        return 1;
+    }
+
+    Import_Node root;
+    uint64_t directories;
+    uint64_t files;
+    if(build_image(path_to_image, options, root, directories, files) == -1){
+        return 1;
+    }
+    cout << directories << " directories, " << files << " files" << endl;
+    return 0;
+}
+#endif
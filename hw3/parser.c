@@ -11,7 +11,7 @@ void parse(parsed_input* inp, char *line) {
 
     tmp = strtok(line, " ");
 
-    inp->arg1 = inp->arg2 = NULL;
+    inp->arg1 = inp->arg2 = inp->arg3 = NULL;
     if ( !strcmp(tmp, "cd") ) {
         inp->type = CD;
     }
@@ -32,6 +32,42 @@ void parse(parsed_input* inp, char *line) {
     }
     else if ( !strcmp(tmp, "quit") ) {
         inp->type = QUIT;
+    }
+    else if ( !strcmp(tmp, "sync") ) {
+        inp->type = SYNC;
+    }
+    else if ( !strcmp(tmp, "cpout") ) {
+        inp->type = CPOUT;
+    }
+    else if ( !strcmp(tmp, "cpin") ) {
+        inp->type = CPIN;
+    }
+    else if ( !strcmp(tmp, "import") ) {
+        inp->type = IMPORT;
+    }
+    else if ( !strcmp(tmp, "find") ) {
+        inp->type = FIND;
+    }
+    else if ( !strcmp(tmp, "du") ) {
+        inp->type = DU;
+    }
+    else if ( !strcmp(tmp, "check") ) {
+        inp->type = CHECK;
+    }
+    else if ( !strcmp(tmp, "defrag") ) {
+        inp->type = DEFRAG;
+    }
+    else if ( !strcmp(tmp, "stats") ) {
+        inp->type = STATS;
+    }
+    else if ( !strcmp(tmp, "compact") ) {
+        inp->type = COMPACT;
+    }
+    else if ( !strcmp(tmp, "rm") ) {
+        inp->type = RM;
+    }
+    else if ( !strcmp(tmp, "rmdir") ) {
+        inp->type = RMDIR;
     }else{
         inp->type = ERR;
     }
@@ -53,12 +89,23 @@ void parse(parsed_input* inp, char *line) {
         inp->arg2 = (char*) calloc(size+1, sizeof(char));
         strcpy(inp->arg2, tmp);
     }
+
+    tmp = strtok(NULL, " ");
+
+    if ( tmp ) {
+        size = strlen(tmp);
+
+        inp->arg3 = (char*) calloc(size+1, sizeof(char));
+        strcpy(inp->arg3, tmp);
+    }
 }
 void clean_input(parsed_input* inp) {
     if ( inp->arg1 )
         free(inp->arg1);
     if ( inp->arg2 )
         free(inp->arg2);
+    if ( inp->arg3 )
+        free(inp->arg3);
 }
 
 char** tokenizePath(char* p){
@@ -16,6 +16,18 @@ typedef enum input_type {
     MV,
     CAT,
     QUIT,
+    SYNC,
+    CPOUT,
+    CPIN,
+    IMPORT,
+    FIND,
+    DU,
+    CHECK,
+    DEFRAG,
+    STATS,
+    COMPACT,
+    RM,
+    RMDIR,
     ERR
 }input_type;
 
@@ -23,6 +35,7 @@ typedef struct parsed_input {
     input_type type;
     char *arg1;
     char *arg2;
+    char *arg3;
 } parsed_input;
 /*
  * Parses a single line of input and separates it into arguments
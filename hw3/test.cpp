@@ -0,0 +1,258 @@
+// Tests of the hw3 shell commands on images generated with mkimage's build_image.
+// Commands go through run_command like in the shell, then the directory entries are checked on the image.
+// Prints one line for each test and exits with 1 if any of them fails.
+#define MKIMAGE_NO_MAIN
+#include "mkimage.cpp"
+
+#define TEST_IMAGE "test.img"
+
+struct Test_Shell{
+    // An empty image opened like main does, with the current directory of one session
+    int fd = -1;
+    unique_ptr<FAT_Block> fblock;
+    unique_ptr<DATA_Block> dblock;
+    string current_directory = "/";
+    int current_cluster = ROOT_DIRECTORY;
+
+    int create(){
+        Image_Options options;
+        options.size_mb = 16;
+        options.sectors_per_cluster = 1; // 16 entries in a cluster, so runs cross clusters soon
+        options.depth = 0;
+        options.files_per_directory = 0;
+        Import_Node root;
+        uint64_t directory_count, file_count;
+        if(build_image(TEST_IMAGE, options, root, directory_count, file_count) == -1){
+            return -1;
+        }
+        fd = open(TEST_IMAGE, O_RDWR);
+        BPB_struct bpb;
+        if(fd < 0 || read(fd, &bpb, BPBS) != BPBS){
+            return -1;
+        }
+        fblock.reset(new FAT_Block(bpb, fd));
+        dblock.reset(new DATA_Block(bpb, fd));
+        name_index.clear(); // caches belong to the previous image
+        path_cache.invalidate("/");
+        return 0;
+    }
+
+    void run(string command){
+        run_command(command, current_directory, current_cluster, *dblock, *fblock);
+    }
+
+    void run_elsewhere(string command){ // as another session, which has its own thread like in the server
+        string directory = "/";
+        int cluster = ROOT_DIRECTORY;
+        thread session([&]{ run_command(command, directory, cluster, *dblock, *fblock); });
+        session.join();
+    }
+
+    int list(string path, vector<Dir_Record> &records, vector<int> &short_numbers){
+        // Entries of the directory at path and the N of their ~N short names. Returns -1 if there is no such directory.
+        string directory = "/";
+        int cluster = ROOT_DIRECTORY;
+        if(cd_(path, directory, cluster, *dblock, *fblock) == -1){
+            return -1;
+        }
+        scan_directory(cluster, *dblock, *fblock, records);
+        for(int i = 0; i < records.size(); i++){
+            Cluster_Handle cluster_handle = dblock->get_from_dblock(records[i].entry_cluster);
+            short_numbers.push_back(short_name_number((FatFile83 *) cluster_handle.data() + records[i].entry_index));
+        }
+        return 0;
+    }
+
+    int contains(string path, string name){ // 1 if the directory at path has an entry called name
+        vector<Dir_Record> records;
+        vector<int> short_numbers;
+        if(list(path, records, short_numbers) == -1){
+            return 0;
+        }
+        for(int i = 0; i < records.size(); i++){
+            if(records[i].name == name){
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    ~Test_Shell(){
+        if(fd >= 0){
+            sync_image(*dblock, *fblock);
+            dblock.reset();
+            fblock.reset();
+            close(fd);
+        }
+        unlink(TEST_IMAGE);
+    }
+};
+
+string check_short_names(Test_Shell &shell, string path){
+    // Every entry of the directory should have its own short name, and its LFN entries its checksum.
+    // Returns what is wrong, empty if nothing is.
+    vector<Dir_Record> records;
+    vector<int> short_numbers;
+    if(shell.list(path, records, short_numbers) == -1){
+        return path + " does not exist";
+    }
+    map<int, string> owners;
+    for(int i = 0; i < records.size(); i++){
+        if(!records[i].checksum_ok){
+            return "bad LFN checksum of " + records[i].name;
+        }
+        auto owner = owners.emplace(short_numbers[i], records[i].name);
+        if(!owner.second){
+            return records[i].name + " and " + owner.first->second + " are both ~" + to_string(short_numbers[i]);
+        }
+    }
+    return "";
+}
+
+string test_short_names_after_move(){
+    // An entry that is moved out lowers the entry count of its directory, the next entry should not reuse a short name
+    Test_Shell shell;
+    if(shell.create() == -1){
+        return "cannot create " TEST_IMAGE;
+    }
+    shell.run("mkdir /d");
+    shell.run("touch /d/a");
+    shell.run("touch /d/b");
+    shell.run("touch /d/c");
+    shell.run("mv /d/a /");
+    shell.run("touch /d/e");
+    string problem = check_short_names(shell, "/d");
+    return problem.empty() ? check_short_names(shell, "/") : problem;
+}
+
+string test_erased_slots_reused(){
+    // A name that fits in the slots of a moved entry is written there, not at the end of the directory
+    Test_Shell shell;
+    if(shell.create() == -1){
+        return "cannot create " TEST_IMAGE;
+    }
+    shell.run("mkdir /d");
+    for(int i = 0; i < 20; i++){ // more than a cluster of entries
+        shell.run("touch /d/file_" + to_string(i));
+    }
+    vector<Dir_Record> before;
+    vector<int> short_numbers;
+    shell.list("/d", before, short_numbers);
+    shell.run("mv /d/file_3 /");
+    shell.run("touch /d/new_3");
+    vector<Dir_Record> after;
+    shell.list("/d", after, short_numbers);
+    Dir_Record *moved = NULL;
+    Dir_Record *created = NULL;
+    for(int i = 0; i < before.size(); i++){
+        if(before[i].name == "file_3"){
+            moved = &before[i];
+        }
+    }
+    for(int i = 0; i < after.size(); i++){
+        if(after[i].name == "new_3"){
+            created = &after[i];
+        }
+    }
+    if(!moved || !created){
+        return "entries are missing";
+    }
+    if(created->lfn_cluster != moved->lfn_cluster || created->lfn_index != moved->lfn_index){
+        return "new_3 is not in the slots of file_3";
+    }
+    return check_short_names(shell, "/d");
+}
+
+string test_short_names_after_rm(){
+    Test_Shell shell;
+    if(shell.create() == -1){
+        return "cannot create " TEST_IMAGE;
+    }
+    shell.run("mkdir /d");
+    shell.run("touch /d/a");
+    shell.run("touch /d/b");
+    shell.run("touch /d/c");
+    shell.run("rm /d/a");
+    shell.run("touch /d/e");
+    return check_short_names(shell, "/d");
+}
+
+string test_rm_directory_of_session(){
+    // A session whose directory is removed by another one goes back to the root instead of writing to freed clusters
+    Test_Shell shell;
+    if(shell.create() == -1){
+        return "cannot create " TEST_IMAGE;
+    }
+    shell.run("mkdir /d");
+    shell.run("mkdir /d/sub");
+    shell.run("cd /d/sub");
+    shell.run_elsewhere("rm -r /d");
+    shell.run_elsewhere("mkdir /x"); // takes the freed clusters
+    shell.run("touch f");
+    if(shell.current_directory != "/"){
+        return "directory is " + shell.current_directory;
+    }
+    if(!shell.contains("/", "f")){
+        return "f is not in the root";
+    }
+    return check_short_names(shell, "/");
+}
+
+string test_mv_directory_of_session(){
+    // A session whose directory is moved, by itself or by another session, follows it to the new path
+    Test_Shell shell;
+    if(shell.create() == -1){
+        return "cannot create " TEST_IMAGE;
+    }
+    shell.run("mkdir a");
+    shell.run("mkdir a/b");
+    shell.run("cd a/b");
+    shell.run("touch f");
+    shell.run("mv /a /c");
+    shell.run("touch g");
+    if(shell.current_directory != "/c/b"){
+        return "directory is " + shell.current_directory + " after its own mv";
+    }
+    if(!shell.contains("/c/b", "f") || !shell.contains("/c/b", "g")){
+        return "f or g is not in /c/b";
+    }
+    shell.run_elsewhere("mkdir /d");
+    shell.run_elsewhere("mv /c /d");
+    shell.run("touch h");
+    if(shell.current_directory != "/d/c/b"){
+        return "directory is " + shell.current_directory + " after the mv of another session";
+    }
+    if(!shell.contains("/d/c/b", "h")){
+        return "h is not in /d/c/b";
+    }
+    return "";
+}
+
+int main()
+{
+    // Command output goes to /dev/null, results to stderr
+    cout.flush();
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, 1);
+    close(null_fd);
+
+    vector<pair<string, function<string()>>> tests = {
+        {"short names after move", test_short_names_after_move},
+        {"erased slots reused", test_erased_slots_reused},
+        {"short names after rm", test_short_names_after_rm},
+        {"rm directory of session", test_rm_directory_of_session},
+        {"mv directory of session", test_mv_directory_of_session},
+    };
+    int failed = 0;
+    for(int i = 0; i < tests.size(); i++){
+        string problem = tests[i].second();
+        if(problem.empty()){
+            fprintf(stderr, "PASS %s\n", tests[i].first.c_str());
+        }
+        else{
+            fprintf(stderr, "FAIL %s: %s\n", tests[i].first.c_str(), problem.c_str());
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}